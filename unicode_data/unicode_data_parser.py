@@ -75,6 +75,73 @@ for line in open("UnicodeData.txt"):
   if parts[2] == "Zl" or parts[2] == "Zp":
     newlines.append(parts[0])
 
+# property bits for the lookup table (the low two bits hold the case)
+PROPERTY_ALPHA = 0x04
+PROPERTY_NUMERIC = 0x08
+PROPERTY_WHITESPACE = 0x10
+PROPERTY_NEWLINE = 0x20
+
+# the upper bound of the code point range
+NUM_CODE_POINTS = 0x110000
+
+# get the offset from a code point to its case mapping (0 if there is none)
+def case_delta(code_point, mapping):
+  if mapping == CODE_POINT_NULL:
+    return 0
+  return int(mapping, 16)-code_point
+
+# compute the properties of every code point that has any
+# (flags, uppercase delta, lowercase delta, titlecase delta)
+properties = {}
+def add_properties(code_point, flags, deltas = (0, 0, 0)):
+  old = properties.get(code_point, (0, 0, 0, 0))
+  properties[code_point] = (old[0] | flags, old[1]+deltas[0], old[2]+deltas[1], old[3]+deltas[2])
+for letter in letters:
+  code_point = int(letter[0], 16)
+  add_properties(code_point, PROPERTY_ALPHA | int(letter[1], 16), (case_delta(code_point, letter[2]), case_delta(code_point, letter[3]), case_delta(code_point, letter[4])))
+for code_point in numbers:
+  add_properties(int(code_point, 16), PROPERTY_NUMERIC)
+for code_point in whitespace:
+  add_properties(int(code_point, 16), PROPERTY_WHITESPACE)
+for code_point in newlines:
+  add_properties(int(code_point, 16), PROPERTY_NEWLINE)
+
+# store each distinct set of properties once (the first record is for code points with no properties)
+records = [(0, 0, 0, 0)]+sorted(set(properties.values())-set([(0, 0, 0, 0)]))
+record_ids = dict([(record, i) for i, record in enumerate(records)])
+if len(records) > 0x100:
+  print "error:  too many distinct property records"
+
+# split the code point range into blocks of record indices and store each distinct block once
+# (the block size is chosen to minimize the total size of both stages)
+def build_property_table(block_shift):
+  block_size = 1 << block_shift
+  block_ids = {}
+  index = []
+  blocks = []
+  for block_start in range(0, NUM_CODE_POINTS, block_size):
+    block = tuple([record_ids[properties.get(code_point, (0, 0, 0, 0))] for code_point in range(block_start, block_start+block_size)])
+    if block not in block_ids:
+      block_ids[block] = len(block_ids)
+      blocks.extend(block)
+    index.append(block_ids[block])
+  return (block_shift, index, blocks)
+
+property_table = None
+for block_shift in range(5, 11):
+  table = build_property_table(block_shift)
+  if max(table[1]) > 0xFF:
+    continue
+  if property_table is None or len(table[1])+len(table[2]) < len(property_table[1])+len(property_table[2]):
+    property_table = table
+
+# write a table of bytes, several per line
+def write_byte_table(f, name, values):
+  f.write("static const uint8_t "+name+"[] = {\n")
+  for i in range(0, len(values), 16):
+    f.write("  "+" ".join(["0x%02X," % value for value in values[i:i+16]])+"\n")
+  f.write("};\n")
+
 # write the header file
 f = open("../unicode_data.h", "w")
 f.write("/*\n")
@@ -86,48 +153,36 @@ f.write("#define UNICODE_DATA_H\n")
 f.write("\n")
 f.write("#include <stdint.h>\n")
 f.write("\n")
-f.write("#define CODE_POINT_NULL 0xFFFFFFFF\n")
-f.write("\n")
 f.write("#define CASE_NONE 0\n")
 f.write("#define CASE_UPPER 1\n")
 f.write("#define CASE_LOWER 2\n")
 f.write("#define CASE_TITLE 3\n")
 f.write("\n")
-f.write("struct letter {\n")
-f.write("  uint32_t code_point;\n")
-f.write("  uint8_t character_case;\n")
-f.write("  uint32_t upper_version;\n")
-f.write("  uint32_t lower_version;\n")
-f.write("  uint32_t title_version;\n")
-f.write("};\n")
+f.write("#define PROPERTY_CASE 0x03\n")
+f.write("#define PROPERTY_ALPHA 0x%02X\n" % PROPERTY_ALPHA)
+f.write("#define PROPERTY_NUMERIC 0x%02X\n" % PROPERTY_NUMERIC)
+f.write("#define PROPERTY_WHITESPACE 0x%02X\n" % PROPERTY_WHITESPACE)
+f.write("#define PROPERTY_NEWLINE 0x%02X\n" % PROPERTY_NEWLINE)
 f.write("\n")
-f.write("#define NUM_LETTERS "+str(len(letters))+"\n");
-f.write("\n")
-f.write("static letter letters[] = {\n")
-for letter in letters:
-  f.write("  {0x"+letter[0]+", 0x"+letter[1]+", 0x"+letter[2]+", 0x"+letter[3]+", 0x"+letter[4]+"},\n")
+f.write("struct character_properties {\n")
+f.write("  uint8_t flags;\n")
+f.write("  int32_t upper_delta;\n")
+f.write("  int32_t lower_delta;\n")
+f.write("  int32_t title_delta;\n")
 f.write("};\n")
 f.write("\n")
-f.write("#define NUM_NUMBERS "+str(len(numbers))+"\n")
+f.write("#define NUM_PROPERTY_RECORDS "+str(len(records))+"\n")
 f.write("\n")
-f.write("static uint32_t numbers[] = {\n")
-for code_point in numbers:
-  f.write("  0x"+code_point+",\n")
+f.write("static const character_properties property_records[] = {\n")
+for record in records:
+  f.write("  {0x%02X, %d, %d, %d},\n" % record)
 f.write("};\n")
 f.write("\n")
-f.write("#define NUM_WHITESPACE "+str(len(whitespace))+"\n")
-f.write("\n")
-f.write("static uint32_t whitespace[] = {\n")
-for code_point in whitespace:
-  f.write("  0x"+code_point+",\n")
-f.write("};\n")
+f.write("#define PROPERTY_BLOCK_SHIFT "+str(property_table[0])+"\n")
 f.write("\n")
-f.write("#define NUM_NEWLINES "+str(len(newlines))+"\n")
+write_byte_table(f, "property_index", property_table[1])
 f.write("\n")
-f.write("static uint32_t newlines[] = {\n")
-for code_point in newlines:
-  f.write("  0x"+code_point+",\n")
-f.write("};\n")
+write_byte_table(f, "property_blocks", property_table[2])
 f.write("\n")
 f.write("#endif\n")
 f.close()
@@ -1,5 +1,30 @@
 #include "utf.h"
 #include "unicode_data.h"
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+
+// the vectorized kernels need x86 and GCC or Clang (define UTF_NO_SIMD to use only the portable code)
+#if !defined(UTF_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define UTF_SIMD_X86
+  #include <immintrin.h>
+#endif
+
+// errors are thrown as encode_error, or abort the program if exceptions are disabled
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+  #define UTF_EXCEPTIONS
+  #define UTF_THROW(message) throw encode_error(message)
+#else
+  #define UTF_THROW(message) ((void)(message), abort())
+#endif
+
+// the parallel functions use std::thread where the language has it (define UTF_NO_THREADS to run them on the calling
+// thread only)
+#if !defined(UTF_NO_THREADS) && __cplusplus >= 201103L
+  #define UTF_THREADS
+  #include <thread>
+#endif
 
 using namespace std;
 using namespace utf;
@@ -14,682 +39,3788 @@ string utf::encode_error::get_message() {
   return message;
 }
 
+// look up the properties of a code point in the two-stage table from unicode_data.h
+static inline const character_properties &get_properties(uint32_t code_point) {
+  return property_records[property_blocks[(property_index[code_point>>PROPERTY_BLOCK_SHIFT]<<PROPERTY_BLOCK_SHIFT)+(code_point&((1<<PROPERTY_BLOCK_SHIFT)-1))]];
+}
+
+// validate ASCII 8 bytes at a time (every byte is a code point)
+static bool validate_ascii_scalar(const uint8_t *data, size_t size, size_t &length) {
+  length = size;
+  size_t pos = 0;
+  for (; pos+8 <= size; pos += 8) {
+    uint64_t word;
+    memcpy(&word, data+pos, 8);
+    if (word&0x8080808080808080ULL)
+      return false;
+  }
+  for (; pos < size; pos++) {
+    if (data[pos] >= 0x80)
+      return false;
+  }
+  return true;
+}
+
+// validate and count UTF-8 one code point at a time, skipping over runs of ASCII
+static bool validate_utf8_scalar(const uint8_t *data, size_t size, size_t &length) {
+  length = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    // skip 8 ASCII bytes at once
+    if (pos+8 <= size) {
+      uint64_t word;
+      memcpy(&word, data+pos, 8);
+      if (!(word&0x8080808080808080ULL)) {
+        pos += 8;
+        length += 8;
+        continue;
+      }
+    }
+
+    // check a single code point
+    size_t char_size = codec<ENCODING_UTF8>::get_char_size(data+pos, size-pos);
+    if (char_size == 0)
+      return false;
+    pos += char_size;
+    ++length;
+  }
+  return true;
+}
+
+// validate and count UTF-16 one code unit at a time (every high surrogate must be followed by a low surrogate and vice versa)
+template <bool big_endian>
+static bool validate_utf16_scalar(const uint8_t *data, size_t size, size_t &length) {
+  length = 0;
+  if (size%2)
+    return false;
+  size_t pos = 0;
+  while (pos < size) {
+    uint16_t unit = utf16_codec<big_endian>::read_unit(data+pos);
+    if (unit >= 0xD800 && unit <= 0xDFFF) {
+      if (unit > 0xDBFF || pos+2 >= size)
+        return false;
+      uint16_t low = utf16_codec<big_endian>::read_unit(data+pos+2);
+      if (low < 0xDC00 || low > 0xDFFF)
+        return false;
+      pos += 2;
+    }
+    pos += 2;
+    ++length;
+  }
+  return true;
+}
+
+// validate UTF-32 one code unit at a time (every unit is a code point other than a surrogate)
+template <bool big_endian>
+static bool validate_utf32_scalar(const uint8_t *data, size_t size, size_t &length) {
+  length = size/4;
+  if (size%4)
+    return false;
+  for (size_t pos = 0; pos < size; pos += 4) {
+    uint32_t unit = utf32_codec<big_endian>::read_unit(data+pos);
+    if (unit > 0x10FFFF || (unit >= 0xD800 && unit <= 0xDFFF))
+      return false;
+  }
+  return true;
+}
+
+// decode the code point at data, returning its size, or 0 if it is malformed, truncated, or the encoding is unknown
+static inline size_t decode_char(const uint8_t *data, size_t available, encoding_type encoding, uint32_t &code_point) {
+  if (encoding == ENCODING_ASCII)
+    return codec<ENCODING_ASCII>::decode(data, available, code_point);
+  if (encoding == ENCODING_UTF8)
+    return codec<ENCODING_UTF8>::decode(data, available, code_point);
+  if (encoding == ENCODING_UTF16BE)
+    return codec<ENCODING_UTF16BE>::decode(data, available, code_point);
+  if (encoding == ENCODING_UTF16LE)
+    return codec<ENCODING_UTF16LE>::decode(data, available, code_point);
+  if (encoding == ENCODING_UTF32BE)
+    return codec<ENCODING_UTF32BE>::decode(data, available, code_point);
+  if (encoding == ENCODING_UTF32LE)
+    return codec<ENCODING_UTF32LE>::decode(data, available, code_point);
+  return 0;
+}
+
+// decode the code point that ends at pos, returning its size, or 0 if it is malformed or the encoding is unknown
+static inline size_t decode_prev_char(const uint8_t *data, size_t pos, encoding_type encoding, uint32_t &code_point) {
+  if (encoding == ENCODING_ASCII)
+    return codec<ENCODING_ASCII>::decode_prev(data, pos, code_point);
+  if (encoding == ENCODING_UTF8)
+    return codec<ENCODING_UTF8>::decode_prev(data, pos, code_point);
+  if (encoding == ENCODING_UTF16BE)
+    return codec<ENCODING_UTF16BE>::decode_prev(data, pos, code_point);
+  if (encoding == ENCODING_UTF16LE)
+    return codec<ENCODING_UTF16LE>::decode_prev(data, pos, code_point);
+  if (encoding == ENCODING_UTF32BE)
+    return codec<ENCODING_UTF32BE>::decode_prev(data, pos, code_point);
+  if (encoding == ENCODING_UTF32LE)
+    return codec<ENCODING_UTF32LE>::decode_prev(data, pos, code_point);
+  return 0;
+}
+
+// find the start of the code point that contains pos (at most size)
+static inline size_t align_char(const uint8_t *data, size_t size, size_t pos, encoding_type encoding) {
+  if (encoding == ENCODING_UTF8)
+    return codec<ENCODING_UTF8>::align(data, size, pos);
+  if (encoding == ENCODING_UTF16BE)
+    return codec<ENCODING_UTF16BE>::align(data, size, pos);
+  if (encoding == ENCODING_UTF16LE)
+    return codec<ENCODING_UTF16LE>::align(data, size, pos);
+  if (encoding == ENCODING_UTF32BE || encoding == ENCODING_UTF32LE)
+    return codec<ENCODING_UTF32BE>::align(data, size, pos);
+  return pos;
+}
+
+// get the decode functions of a codec
+template <encoding_type encoding>
+static char_decoder make_char_decoder() {
+  char_decoder decoder;
+  decoder.decode = codec<encoding>::decode;
+  decoder.decode_prev = codec<encoding>::decode_prev;
+  decoder.unit_size = codec<encoding>::unit_size;
+  return decoder;
+}
+
+// encode a code point (at most U+10FFFF), returning the number of bytes written, or 0 if the encoding can't represent it
+static inline size_t encode_char(uint32_t code_point, encoding_type encoding, uint8_t *output) {
+  if (encoding == ENCODING_ASCII)
+    return codec<ENCODING_ASCII>::encode(code_point, output);
+  if (encoding == ENCODING_UTF8)
+    return codec<ENCODING_UTF8>::encode(code_point, output);
+  if (encoding == ENCODING_UTF16BE)
+    return codec<ENCODING_UTF16BE>::encode(code_point, output);
+  if (encoding == ENCODING_UTF16LE)
+    return codec<ENCODING_UTF16LE>::encode(code_point, output);
+  if (encoding == ENCODING_UTF32BE)
+    return codec<ENCODING_UTF32BE>::encode(code_point, output);
+  if (encoding == ENCODING_UTF32LE)
+    return codec<ENCODING_UTF32LE>::encode(code_point, output);
+  return 0;
+}
+
+// make a status for the functions that don't throw
+static inline status make_status(error_type error, size_t offset) {
+  status result;
+  result.error = error;
+  result.offset = offset;
+  return result;
+}
+
+// get the message the throwing functions use for an error (why a code point can't be encoded depends on the encoding)
+static const char *get_error_message(error_type error, encoding_type output_encoding) {
+  if (error == ERROR_UNKNOWN_INPUT_ENCODING)
+    return "unknown input encoding";
+  if (error == ERROR_UNKNOWN_OUTPUT_ENCODING)
+    return "unknown output encoding";
+  if (error == ERROR_MALFORMED_INPUT)
+    return "malformed input string";
+  if (error == ERROR_INVALID_CODE_POINT)
+    return "invalid code point";
+  if (error == ERROR_INDEX_OUT_OF_RANGE)
+    return "index out of range";
+  if (error == ERROR_INVALID_INDEX)
+    return "index does not refer to a valid code point";
+  if (error == ERROR_OUTPUT_TOO_SMALL)
+    return "output buffer too small";
+  if (output_encoding == ENCODING_ASCII)
+    return "invalid code point for ASCII";
+  if (output_encoding == ENCODING_UTF16BE || output_encoding == ENCODING_UTF16LE)
+    return "unable to encode code points U+D800 to U+DFFF in UTF-16";
+  if (output_encoding == ENCODING_UTF8)
+    return "unable to encode code points U+D800 to U+DFFF in UTF-8";
+  return "unable to encode code points U+D800 to U+DFFF in UTF-32";
+}
+
+// get the most bytes that converting size bytes from one encoding to another can produce
+static size_t get_max_output_size(size_t size, encoding_type input_encoding, encoding_type output_encoding) {
+  // the smallest code unit in the input
+  size_t input_unit = 1;
+  if (input_encoding == ENCODING_UTF16BE || input_encoding == ENCODING_UTF16LE)
+    input_unit = 2;
+  if (input_encoding == ENCODING_UTF32BE || input_encoding == ENCODING_UTF32LE)
+    input_unit = 4;
+
+  // the most output bytes per input code unit (a code point that takes 4 bytes in UTF-8 takes 2 units in UTF-16)
+  size_t output_per_unit = 1;
+  if (output_encoding == ENCODING_UTF8)
+    output_per_unit = input_unit == 1 ? 1 : (input_unit == 2 ? 3 : 4);
+  if (output_encoding == ENCODING_UTF16BE || output_encoding == ENCODING_UTF16LE)
+    output_per_unit = input_unit == 1 ? 2 : (input_unit == 2 ? 2 : 4);
+  if (output_encoding == ENCODING_UTF32BE || output_encoding == ENCODING_UTF32LE)
+    output_per_unit = 4;
+  return size/input_unit*output_per_unit;
+}
+
+// reverse the bytes of each code unit
+template <size_t unit_size>
+static void swap_units_scalar(const uint8_t *data, size_t size, uint8_t *output) {
+  for (size_t pos = 0; pos+unit_size <= size; pos += unit_size) {
+    for (size_t i = 0; i < unit_size; i++)
+      output[pos+i] = data[pos+unit_size-1-i];
+  }
+}
+
+// add up the zero bytes at each offset from a multiple of 4, 8 bytes at a time
+static void count_zeros_scalar(const uint8_t *data, size_t size, size_t zeros[4]) {
+  size_t pos = 0;
+  while (pos+8 <= size) {
+    // set the low bit of each byte of a word that is zero, and add them up in the bytes of a sum, which can take 255
+    // words before they overflow
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 255 && pos+8 <= size; i++) {
+      uint64_t word;
+      memcpy(&word, data+pos, 8);
+      sum += ~(((word&0x7F7F7F7F7F7F7F7FULL)+0x7F7F7F7F7F7F7F7FULL)|word|0x7F7F7F7F7F7F7F7FULL)>>7;
+      pos += 8;
+    }
+    uint8_t counts[8];
+    memcpy(counts, &sum, 8);
+    for (size_t i = 0; i < 8; i++)
+      zeros[i%4] += counts[i];
+  }
+  for (; pos < size; pos++) {
+    if (data[pos] == 0)
+      ++zeros[pos%4];
+  }
+}
+
+// measure valid ASCII
+static void measure_ascii_scalar(const uint8_t *, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  utf8_size = size;
+  utf16_size = size*2;
+}
+
+// measure valid UTF-8 one code point at a time (a code point takes two units in UTF-16 if it has four bytes)
+static void measure_utf8_scalar(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  utf8_size = size;
+  utf16_size = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t char_size = codec<ENCODING_UTF8>::get_char_size(data+pos, size-pos);
+    utf16_size += char_size == 4 ? 4 : 2;
+    pos += char_size;
+  }
+}
+
+// measure valid UTF-16 one code unit at a time (each half of a surrogate pair takes 2 bytes in UTF-8)
+template <bool big_endian>
+static void measure_utf16_scalar(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  utf8_size = 0;
+  utf16_size = size;
+  for (size_t pos = 0; pos+2 <= size; pos += 2) {
+    uint16_t unit = utf16_codec<big_endian>::read_unit(data+pos);
+    utf8_size += unit < 0x80 ? 1 : (unit < 0x800 || (unit >= 0xD800 && unit <= 0xDFFF) ? 2 : 3);
+  }
+}
+
+// measure valid UTF-32 one code unit at a time
+template <bool big_endian>
+static void measure_utf32_scalar(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  utf8_size = 0;
+  utf16_size = 0;
+  for (size_t pos = 0; pos+4 <= size; pos += 4) {
+    uint32_t code_point = utf32_codec<big_endian>::read_unit(data+pos);
+    utf8_size += code_point < 0x80 ? 1 : (code_point < 0x800 ? 2 : (code_point < 0x10000 ? 3 : 4));
+    utf16_size += code_point < 0x10000 ? 2 : 4;
+  }
+}
+
+// a bulk validator for a particular encoding (the length is the number of code points, if valid)
+typedef bool (*validator)(const uint8_t *data, size_t size, size_t &length);
+
+// a bulk measurer finds the size of a valid string in UTF-8 and in UTF-16
+typedef void (*measurer)(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size);
+
+// a bulk transcoder between two encodings (it returns the number of input bytes it converted)
+typedef size_t (*transcoder)(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size);
+
+// reverses the byte order of a string of code units
+typedef void (*swapper)(const uint8_t *data, size_t size, uint8_t *output);
+
+// adds up the zero bytes of a string at each offset from a multiple of 4
+typedef void (*zero_counter)(const uint8_t *data, size_t size, size_t zeros[4]);
+
+// the fastest kernels supported by the CPU (a missing transcoder means the scalar code does the conversion, and the
+// valid transcoders skip validation for input that is known to be valid)
+struct kernel_table {
+  validator validate_ascii;
+  validator validate_utf8;
+  validator validate_utf16be;
+  validator validate_utf16le;
+  validator validate_utf32be;
+  validator validate_utf32le;
+  measurer measure_ascii;
+  measurer measure_utf8;
+  measurer measure_utf16be;
+  measurer measure_utf16le;
+  measurer measure_utf32be;
+  measurer measure_utf32le;
+  transcoder utf8_to_utf16be;
+  transcoder utf8_to_utf16le;
+  transcoder utf16be_to_utf8;
+  transcoder utf16le_to_utf8;
+  transcoder utf8_to_utf32be;
+  transcoder utf8_to_utf32le;
+  transcoder utf32be_to_utf8;
+  transcoder utf32le_to_utf8;
+  transcoder valid_utf8_to_utf16be;
+  transcoder valid_utf8_to_utf16le;
+  transcoder valid_utf16be_to_utf8;
+  transcoder valid_utf16le_to_utf8;
+  transcoder valid_utf8_to_utf32be;
+  transcoder valid_utf8_to_utf32le;
+  transcoder valid_utf32be_to_utf8;
+  transcoder valid_utf32le_to_utf8;
+  swapper swap_utf16;
+  swapper swap_utf32;
+  zero_counter count_zeros;
+};
+
+// get the kernels for this CPU
+static const kernel_table &get_kernels();
+
+// the number of input bytes to validate at once before converting them
+#define TRANSCODE_CHUNK_SIZE 16384
+
+// the number of input bytes to convert at once through a scratch buffer, when the output buffer is too small for the
+// longest possible output of a whole chunk
+#define SCRATCH_CHUNK_SIZE 1024
+
+// find the end of the chunk of at most chunk_size bytes that starts at pos, without splitting a code point between chunks
+static size_t get_chunk_end(const uint8_t *data, size_t pos, size_t size, encoding_type encoding, size_t chunk_size) {
+  if (size-pos <= chunk_size)
+    return size;
+  size_t end = pos+chunk_size;
+
+  // end the chunk at the start of a code point (if it is valid)
+  if (encoding == ENCODING_UTF8) {
+    for (size_t i = 0; i < 3 && (data[end]&0xC0) == 0x80; i++)
+      --end;
+  }
+
+  // don't split a surrogate pair
+  if (encoding == ENCODING_UTF16BE || encoding == ENCODING_UTF16LE) {
+    if ((data[end-(encoding == ENCODING_UTF16BE ? 2 : 1)]&0xFC) == 0xD8)
+      end -= 2;
+  }
+  return end;
+}
+
+#ifdef UTF_SIMD_X86
+
+// the vectorized UTF-8 validators look up the nibbles of each pair of bytes in three tables, and the pair is malformed
+// if all three share an error bit (the third and fourth bytes of long sequences are checked separately, and the tables
+// reject the same sequences as the state machine in codec<ENCODING_UTF8>)
+
+// error bits for pairs of bytes
+#define UTF8_TOO_SHORT (1<<0)      // 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG (1<<1)       // 0_______ 10______
+#define UTF8_OVERLONG_3 (1<<2)     // 11100000 100_____
+#define UTF8_TOO_LARGE (1<<3)      // 11110100 1001____ or 11110100 101_____ or 11110101+ 1001____ etc.
+#define UTF8_SURROGATE (1<<4)      // 11101101 101_____
+#define UTF8_OVERLONG_2 (1<<5)     // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1<<6) // 11110101+ 1000____
+#define UTF8_OVERLONG_4 (1<<6)     // 11110000 1000____
+#define UTF8_TWO_CONTS (1<<7)      // 10______ 10______
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// lookup tables, indexed by the high nibble of the first byte, the low nibble of
+// the first byte, and the high nibble of the second byte of each pair
+static const uint8_t utf8_byte_1_high[16] = {
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+  UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+  UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+  UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+static const uint8_t utf8_byte_1_low[16] = {
+  UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+  UTF8_CARRY | UTF8_OVERLONG_2,
+  UTF8_CARRY,
+  UTF8_CARRY,
+  UTF8_CARRY | UTF8_TOO_LARGE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+  UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+static const uint8_t utf8_byte_2_high[16] = {
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+  UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+// the largest values of the last three bytes of a block that do not start an unfinished sequence
+static const uint8_t utf8_max_complete[64] = {
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+  0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0-1, 0xE0-1, 0xC0-1
+};
+
+// shuffles that load 32-bit units in native byte order
+static const uint8_t utf32_native_order[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+static const uint8_t utf32_swap_order[16] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+
+// shuffles that load 16-bit units in native byte order
+static const uint8_t utf16_native_order[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+static const uint8_t utf16_swap_order[16] = {1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14};
+
+// validate ASCII 16 bytes at a time
+__attribute__((target("sse4.2,popcnt")))
+static bool validate_ascii_sse42(const uint8_t *data, size_t size, size_t &length) {
+  size_t pos = 0;
+  for (; pos+16 <= size; pos += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data+pos))))
+      return false;
+  }
+  bool valid = validate_ascii_scalar(data+pos, size-pos, length);
+  length = size;
+  return valid;
+}
+
+// find the malformed bytes in a 16-byte block
+__attribute__((target("sse4.2,popcnt")))
+static inline __m128i check_utf8_block_sse42(__m128i input, __m128i prev_input) {
+  const __m128i low_nibble = _mm_set1_epi8(0x0F);
+  const __m128i prev1 = _mm_alignr_epi8(input, prev_input, 16-1);
+  const __m128i byte_1_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)utf8_byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+  const __m128i byte_1_low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)utf8_byte_1_low), _mm_and_si128(prev1, low_nibble));
+  const __m128i byte_2_high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)utf8_byte_2_high), _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+  const __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+  // the bytes two and three positions after a 3- and 4-byte lead must be continuation bytes
+  const __m128i prev2 = _mm_alignr_epi8(input, prev_input, 16-2);
+  const __m128i prev3 = _mm_alignr_epi8(input, prev_input, 16-3);
+  const __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8(0xE0-0x80));
+  const __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8(0xF0-0x80));
+  const __m128i must_be_continuation = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char)0x80));
+  return _mm_xor_si128(must_be_continuation, special_cases);
+}
+
+// validate and count UTF-8 16 bytes at a time (every byte except a continuation byte starts a code point)
+__attribute__((target("sse4.2,popcnt")))
+static bool validate_utf8_sse42(const uint8_t *data, size_t size, size_t &length) {
+  const __m128i max_complete = _mm_loadu_si128((const __m128i *)(utf8_max_complete+64-16));
+  const __m128i max_continuation = _mm_set1_epi8((char)0xBF);
+  __m128i error = _mm_setzero_si128();
+  __m128i prev_input = _mm_setzero_si128();
+  __m128i prev_incomplete = _mm_setzero_si128();
+  size_t count = 0;
+  for (size_t pos = 0; pos < size; pos += 16) {
+    // load the next block, padding the last one with zeros
+    __m128i input;
+    if (size-pos >= 16)
+      input = _mm_loadu_si128((const __m128i *)(data+pos));
+    else {
+      uint8_t block[16] = {0};
+      memcpy(block, data+pos, size-pos);
+      input = _mm_loadu_si128((const __m128i *)block);
+    }
+
+    // an ASCII block is valid unless the previous block ended in the middle of a code point
+    if (_mm_movemask_epi8(input) == 0) {
+      error = _mm_or_si128(error, prev_incomplete);
+      count += 16;
+    } else {
+      error = _mm_or_si128(error, check_utf8_block_sse42(input, prev_input));
+      prev_incomplete = _mm_subs_epu8(input, max_complete);
+      count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi8(input, max_continuation)));
+    }
+    prev_input = input;
+    if (!_mm_testz_si128(error, error))
+      return false;
+  }
+
+  // don't count the padding
+  length = count-(size%16 ? 16-size%16 : 0);
+  return _mm_testz_si128(prev_incomplete, prev_incomplete);
+}
+
+// validate and count UTF-16 16 code units at a time by matching the positions of the high and low surrogates
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static bool validate_utf16_sse42(const uint8_t *data, size_t size, size_t &length) {
+  length = 0;
+  if (size%2)
+    return false;
+
+  // the top six bits of the most significant byte of each unit identify surrogates
+  const __m128i shift = _mm_cvtsi32_si128(big_endian ? 0 : 8);
+  const __m128i surrogate_bits = _mm_set1_epi16(0xFC);
+  const __m128i high_surrogate = _mm_set1_epi16(0xD8);
+  const __m128i low_surrogate = _mm_set1_epi16(0xDC);
+  uint32_t carry = 0;
+  size_t count = 0;
+  size_t pos = 0;
+  for (; pos+32 <= size; pos += 32) {
+    const __m128i first = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)(data+pos)), shift), surrogate_bits);
+    const __m128i second = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128((const __m128i *)(data+pos+16)), shift), surrogate_bits);
+    const uint32_t highs = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(first, high_surrogate), _mm_cmpeq_epi16(second, high_surrogate)));
+    const uint32_t lows = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpeq_epi16(first, low_surrogate), _mm_cmpeq_epi16(second, low_surrogate)));
+
+    // each low surrogate must directly follow a high surrogate
+    if ((((highs<<1)|carry)&0xFFFF) != lows)
+      return false;
+    carry = highs>>15;
+    count += 16-__builtin_popcount(lows);
+  }
+
+  // finish with the scalar validator, backing up if the block ended with a high surrogate
+  if (carry) {
+    pos -= 2;
+    count -= 1;
+  }
+  bool valid = validate_utf16_scalar<big_endian>(data+pos, size-pos, length);
+  length += count;
+  return valid;
+}
+
+// validate UTF-32 4 code units at a time
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static bool validate_utf32_sse42(const uint8_t *data, size_t size, size_t &length) {
+  length = size/4;
+  if (size%4)
+    return false;
+
+  // find the largest unit (in native byte order) and look for surrogates
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf32_swap_order : utf32_native_order));
+  const __m128i max_code_point = _mm_set1_epi32(0x10FFFF);
+  __m128i max_unit = _mm_setzero_si128();
+  __m128i surrogates = _mm_setzero_si128();
+  size_t pos = 0;
+  for (; pos+16 <= size; pos += 16) {
+    const __m128i units = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order);
+    max_unit = _mm_max_epu32(max_unit, units);
+    surrogates = _mm_or_si128(surrogates, _mm_cmpeq_epi32(_mm_and_si128(units, _mm_set1_epi32(0xFFFFF800)), _mm_set1_epi32(0xD800)));
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_max_epu32(max_unit, max_code_point), max_code_point)) != 0xFFFF)
+    return false;
+  if (!_mm_testz_si128(surrogates, surrogates))
+    return false;
+
+  // finish with the scalar validator
+  size_t tail_length;
+  return validate_utf32_scalar<big_endian>(data+pos, size-pos, tail_length);
+}
+
+// reverse the bytes of each code unit, 16 bytes at a time
+template <size_t unit_size>
+__attribute__((target("sse4.2,popcnt")))
+static void swap_units_sse42(const uint8_t *data, size_t size, uint8_t *output) {
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(unit_size == 2 ? utf16_swap_order : utf32_swap_order));
+  size_t pos = 0;
+  for (; pos+16 <= size; pos += 16)
+    _mm_storeu_si128((__m128i *)(output+pos), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order));
+  swap_units_scalar<unit_size>(data+pos, size-pos, output+pos);
+}
+
+// add up the zero bytes at each offset from a multiple of 4, 16 bytes at a time
+__attribute__((target("sse4.2,popcnt")))
+static void count_zeros_sse42(const uint8_t *data, size_t size, size_t zeros[4]) {
+  size_t pos = 0;
+  while (pos+16 <= size) {
+    // count the zeros in each byte for up to 255 blocks, before the counts overflow
+    __m128i sum = _mm_setzero_si128();
+    for (size_t i = 0; i < 255 && pos+16 <= size; i++) {
+      sum = _mm_sub_epi8(sum, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), _mm_setzero_si128()));
+      pos += 16;
+    }
+    uint8_t counts[16];
+    _mm_storeu_si128((__m128i *)counts, sum);
+    for (size_t i = 0; i < 16; i++)
+      zeros[i%4] += counts[i];
+  }
+  count_zeros_scalar(data+pos, size-pos, zeros);
+}
+
+// validate ASCII 32 bytes at a time
+__attribute__((target("avx2,popcnt")))
+static bool validate_ascii_avx2(const uint8_t *data, size_t size, size_t &length) {
+  size_t pos = 0;
+  for (; pos+32 <= size; pos += 32) {
+    if (_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(data+pos))))
+      return false;
+  }
+  bool valid = validate_ascii_scalar(data+pos, size-pos, length);
+  length = size;
+  return valid;
+}
+
+// broadcast a 16-entry lookup table to both 128-bit lanes
+__attribute__((target("avx2,popcnt")))
+static inline __m256i load_table_avx2(const uint8_t *table) {
+  return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+}
+
+// find the malformed bytes in a 32-byte block
+__attribute__((target("avx2,popcnt")))
+static inline __m256i check_utf8_block_avx2(__m256i input, __m256i prev_input) {
+  const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+  const __m256i shifted = _mm256_permute2x128_si256(prev_input, input, 0x21);
+  const __m256i prev1 = _mm256_alignr_epi8(input, shifted, 16-1);
+  const __m256i byte_1_high = _mm256_shuffle_epi8(load_table_avx2(utf8_byte_1_high), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+  const __m256i byte_1_low = _mm256_shuffle_epi8(load_table_avx2(utf8_byte_1_low), _mm256_and_si256(prev1, low_nibble));
+  const __m256i byte_2_high = _mm256_shuffle_epi8(load_table_avx2(utf8_byte_2_high), _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+  const __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+  // the bytes two and three positions after a 3- and 4-byte lead must be continuation bytes
+  const __m256i prev2 = _mm256_alignr_epi8(input, shifted, 16-2);
+  const __m256i prev3 = _mm256_alignr_epi8(input, shifted, 16-3);
+  const __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0-0x80));
+  const __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0-0x80));
+  const __m256i must_be_continuation = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte), _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must_be_continuation, special_cases);
+}
+
+// validate and count UTF-8 32 bytes at a time (every byte except a continuation byte starts a code point)
+__attribute__((target("avx2,popcnt")))
+static bool validate_utf8_avx2(const uint8_t *data, size_t size, size_t &length) {
+  const __m256i max_complete = _mm256_loadu_si256((const __m256i *)(utf8_max_complete+64-32));
+  const __m256i max_continuation = _mm256_set1_epi8((char)0xBF);
+  __m256i error = _mm256_setzero_si256();
+  __m256i prev_input = _mm256_setzero_si256();
+  __m256i prev_incomplete = _mm256_setzero_si256();
+  size_t count = 0;
+  for (size_t pos = 0; pos < size; pos += 32) {
+    // load the next block, padding the last one with zeros
+    __m256i input;
+    if (size-pos >= 32)
+      input = _mm256_loadu_si256((const __m256i *)(data+pos));
+    else {
+      uint8_t block[32] = {0};
+      memcpy(block, data+pos, size-pos);
+      input = _mm256_loadu_si256((const __m256i *)block);
+    }
+
+    // an ASCII block is valid unless the previous block ended in the middle of a code point
+    if (_mm256_movemask_epi8(input) == 0) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      count += 32;
+    } else {
+      error = _mm256_or_si256(error, check_utf8_block_avx2(input, prev_input));
+      prev_incomplete = _mm256_subs_epu8(input, max_complete);
+      count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi8(input, max_continuation)));
+    }
+    prev_input = input;
+    if (!_mm256_testz_si256(error, error))
+      return false;
+  }
+
+  // don't count the padding
+  length = count-(size%32 ? 32-size%32 : 0);
+  return _mm256_testz_si256(prev_incomplete, prev_incomplete);
+}
+
+// validate and count UTF-16 32 code units at a time by matching the positions of the high and low surrogates
+template <bool big_endian>
+__attribute__((target("avx2,popcnt")))
+static bool validate_utf16_avx2(const uint8_t *data, size_t size, size_t &length) {
+  length = 0;
+  if (size%2)
+    return false;
+
+  // the top six bits of the most significant byte of each unit identify surrogates
+  const __m128i shift = _mm_cvtsi32_si128(big_endian ? 0 : 8);
+  const __m256i surrogate_bits = _mm256_set1_epi16(0xFC);
+  const __m256i high_surrogate = _mm256_set1_epi16(0xD8);
+  const __m256i low_surrogate = _mm256_set1_epi16(0xDC);
+  uint32_t carry = 0;
+  size_t count = 0;
+  size_t pos = 0;
+  for (; pos+64 <= size; pos += 64) {
+    const __m256i first = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(data+pos)), shift), surrogate_bits);
+    const __m256i second = _mm256_and_si256(_mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(data+pos+32)), shift), surrogate_bits);
+
+    // packing works within 128-bit lanes, so put the 64-bit quarters back in order afterward
+    const uint32_t highs = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpeq_epi16(first, high_surrogate), _mm256_cmpeq_epi16(second, high_surrogate)), 0xD8));
+    const uint32_t lows = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpeq_epi16(first, low_surrogate), _mm256_cmpeq_epi16(second, low_surrogate)), 0xD8));
+
+    // each low surrogate must directly follow a high surrogate
+    if (((highs<<1)|carry) != lows)
+      return false;
+    carry = highs>>31;
+    count += 32-__builtin_popcount(lows);
+  }
+
+  // finish with the scalar validator, backing up if the block ended with a high surrogate
+  if (carry) {
+    pos -= 2;
+    count -= 1;
+  }
+  bool valid = validate_utf16_scalar<big_endian>(data+pos, size-pos, length);
+  length += count;
+  return valid;
+}
+
+// validate UTF-32 8 code units at a time
+template <bool big_endian>
+__attribute__((target("avx2,popcnt")))
+static bool validate_utf32_avx2(const uint8_t *data, size_t size, size_t &length) {
+  length = size/4;
+  if (size%4)
+    return false;
+
+  // find the largest unit (in native byte order) and look for surrogates
+  const __m256i byte_order = load_table_avx2(big_endian ? utf32_swap_order : utf32_native_order);
+  const __m256i max_code_point = _mm256_set1_epi32(0x10FFFF);
+  __m256i max_unit = _mm256_setzero_si256();
+  __m256i surrogates = _mm256_setzero_si256();
+  size_t pos = 0;
+  for (; pos+32 <= size; pos += 32) {
+    const __m256i units = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data+pos)), byte_order);
+    max_unit = _mm256_max_epu32(max_unit, units);
+    surrogates = _mm256_or_si256(surrogates, _mm256_cmpeq_epi32(_mm256_and_si256(units, _mm256_set1_epi32(0xFFFFF800)), _mm256_set1_epi32(0xD800)));
+  }
+  if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_max_epu32(max_unit, max_code_point), max_code_point)) != -1)
+    return false;
+  if (!_mm256_testz_si256(surrogates, surrogates))
+    return false;
+
+  // finish with the scalar validator
+  size_t tail_length;
+  return validate_utf32_scalar<big_endian>(data+pos, size-pos, tail_length);
+}
+
+// reverse the bytes of each code unit, 32 bytes at a time
+template <size_t unit_size>
+__attribute__((target("avx2,popcnt")))
+static void swap_units_avx2(const uint8_t *data, size_t size, uint8_t *output) {
+  const __m256i byte_order = load_table_avx2(unit_size == 2 ? utf16_swap_order : utf32_swap_order);
+  size_t pos = 0;
+  for (; pos+32 <= size; pos += 32)
+    _mm256_storeu_si256((__m256i *)(output+pos), _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(data+pos)), byte_order));
+  swap_units_scalar<unit_size>(data+pos, size-pos, output+pos);
+}
+
+// add up the zero bytes at each offset from a multiple of 4, 32 bytes at a time
+__attribute__((target("avx2,popcnt")))
+static void count_zeros_avx2(const uint8_t *data, size_t size, size_t zeros[4]) {
+  size_t pos = 0;
+  while (pos+32 <= size) {
+    // count the zeros in each byte for up to 255 blocks, before the counts overflow
+    __m256i sum = _mm256_setzero_si256();
+    for (size_t i = 0; i < 255 && pos+32 <= size; i++) {
+      sum = _mm256_sub_epi8(sum, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data+pos)), _mm256_setzero_si256()));
+      pos += 32;
+    }
+    uint8_t counts[32];
+    _mm256_storeu_si256((__m256i *)counts, sum);
+    for (size_t i = 0; i < 32; i++)
+      zeros[i%4] += counts[i];
+  }
+  count_zeros_scalar(data+pos, size-pos, zeros);
+}
+
+// validate ASCII 64 bytes at a time
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static bool validate_ascii_avx512(const uint8_t *data, size_t size, size_t &length) {
+  length = size;
+  for (size_t pos = 0; pos < size; pos += 64) {
+    const __mmask64 mask = size-pos >= 64 ? ~(__mmask64)0 : ((__mmask64)1<<(size-pos))-1;
+    if (_mm512_movepi8_mask(_mm512_maskz_loadu_epi8(mask, data+pos)))
+      return false;
+  }
+  return true;
+}
+
+// broadcast a 16-entry lookup table to all four 128-bit lanes
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline __m512i load_table_avx512(const uint8_t *table) {
+  return _mm512_maskz_broadcast_i32x4((__mmask16)-1, _mm_loadu_si128((const __m128i *)table));
+}
+
+// find the malformed bytes in a 64-byte block
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline __m512i check_utf8_block_avx512(__m512i input, __m512i prev_input) {
+  const __m512i low_nibble = _mm512_set1_epi8(0x0F);
+  const __m512i shifted = _mm512_permutex2var_epi64(prev_input, _mm512_set_epi64(13, 12, 11, 10, 9, 8, 7, 6), input);
+  const __m512i prev1 = _mm512_alignr_epi8(input, shifted, 16-1);
+  const __m512i byte_1_high = _mm512_shuffle_epi8(load_table_avx512(utf8_byte_1_high), _mm512_and_si512(_mm512_srli_epi16(prev1, 4), low_nibble));
+  const __m512i byte_1_low = _mm512_shuffle_epi8(load_table_avx512(utf8_byte_1_low), _mm512_and_si512(prev1, low_nibble));
+  const __m512i byte_2_high = _mm512_shuffle_epi8(load_table_avx512(utf8_byte_2_high), _mm512_and_si512(_mm512_srli_epi16(input, 4), low_nibble));
+  const __m512i special_cases = _mm512_and_si512(_mm512_and_si512(byte_1_high, byte_1_low), byte_2_high);
+
+  // the bytes two and three positions after a 3- and 4-byte lead must be continuation bytes
+  const __m512i prev2 = _mm512_alignr_epi8(input, shifted, 16-2);
+  const __m512i prev3 = _mm512_alignr_epi8(input, shifted, 16-3);
+  const __m512i is_third_byte = _mm512_subs_epu8(prev2, _mm512_set1_epi8(0xE0-0x80));
+  const __m512i is_fourth_byte = _mm512_subs_epu8(prev3, _mm512_set1_epi8(0xF0-0x80));
+  const __m512i must_be_continuation = _mm512_and_si512(_mm512_or_si512(is_third_byte, is_fourth_byte), _mm512_set1_epi8((char)0x80));
+  return _mm512_xor_si512(must_be_continuation, special_cases);
+}
+
+// validate and count UTF-8 64 bytes at a time (every byte except a continuation byte starts a code point)
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static bool validate_utf8_avx512(const uint8_t *data, size_t size, size_t &length) {
+  const __m512i max_complete = _mm512_loadu_si512((const void *)utf8_max_complete);
+  const __m512i max_continuation = _mm512_set1_epi8((char)0xBF);
+  __m512i error = _mm512_setzero_si512();
+  __m512i prev_input = _mm512_setzero_si512();
+  __m512i prev_incomplete = _mm512_setzero_si512();
+  size_t count = 0;
+  for (size_t pos = 0; pos < size; pos += 64) {
+    // load the next block, leaving out the bytes past the end
+    const __mmask64 mask = size-pos >= 64 ? ~(__mmask64)0 : ((__mmask64)1<<(size-pos))-1;
+    const __m512i input = _mm512_maskz_loadu_epi8(mask, data+pos);
+
+    // an ASCII block is valid unless the previous block ended in the middle of a code point
+    if (_mm512_movepi8_mask(input) == 0) {
+      error = _mm512_or_si512(error, prev_incomplete);
+      count += __builtin_popcountll(mask);
+    } else {
+      error = _mm512_or_si512(error, check_utf8_block_avx512(input, prev_input));
+      prev_incomplete = _mm512_subs_epu8(input, max_complete);
+      count += __builtin_popcountll(_mm512_mask_cmpgt_epi8_mask(mask, input, max_continuation));
+    }
+    prev_input = input;
+    if (_mm512_test_epi8_mask(error, error))
+      return false;
+  }
+  length = count;
+  return _mm512_test_epi8_mask(prev_incomplete, prev_incomplete) == 0;
+}
+
+// validate and count UTF-16 32 code units at a time by matching the positions of the high and low surrogates
+template <bool big_endian>
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static bool validate_utf16_avx512(const uint8_t *data, size_t size, size_t &length) {
+  length = 0;
+  if (size%2)
+    return false;
+
+  // the top six bits of the most significant byte of each unit identify surrogates
+  const __m128i shift = _mm_cvtsi32_si128(big_endian ? 0 : 8);
+  const __m512i surrogate_bits = _mm512_set1_epi16(0xFC);
+  const __m512i high_surrogate = _mm512_set1_epi16(0xD8);
+  const __m512i low_surrogate = _mm512_set1_epi16(0xDC);
+  uint32_t carry = 0;
+  size_t count = 0;
+  size_t pos = 0;
+  for (; pos+64 <= size; pos += 64) {
+    const __m512i units = _mm512_and_si512(_mm512_srl_epi16(_mm512_loadu_si512((const void *)(data+pos)), shift), surrogate_bits);
+    const uint32_t highs = _mm512_cmpeq_epi16_mask(units, high_surrogate);
+    const uint32_t lows = _mm512_cmpeq_epi16_mask(units, low_surrogate);
+
+    // each low surrogate must directly follow a high surrogate
+    if (((highs<<1)|carry) != lows)
+      return false;
+    carry = highs>>31;
+    count += 32-__builtin_popcount(lows);
+  }
+
+  // finish with the scalar validator, backing up if the block ended with a high surrogate
+  if (carry) {
+    pos -= 2;
+    count -= 1;
+  }
+  bool valid = validate_utf16_scalar<big_endian>(data+pos, size-pos, length);
+  length += count;
+  return valid;
+}
+
+// validate UTF-32 16 code units at a time
+template <bool big_endian>
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static bool validate_utf32_avx512(const uint8_t *data, size_t size, size_t &length) {
+  length = size/4;
+  if (size%4)
+    return false;
+
+  // look for units above U+10FFFF and surrogates (in native byte order), leaving out the bytes past the end
+  const __m512i byte_order = load_table_avx512(big_endian ? utf32_swap_order : utf32_native_order);
+  const __m512i max_code_point = _mm512_set1_epi32(0x10FFFF);
+  __mmask16 invalid = 0;
+  for (size_t pos = 0; pos < size; pos += 64) {
+    const __mmask16 mask = size-pos >= 64 ? (__mmask16)0xFFFF : (__mmask16)((1<<((size-pos)/4))-1);
+    const __m512i units = _mm512_shuffle_epi8(_mm512_maskz_loadu_epi32(mask, data+pos), byte_order);
+    invalid |= _mm512_cmpgt_epu32_mask(units, max_code_point);
+    invalid |= _mm512_cmplt_epu32_mask(_mm512_xor_si512(units, _mm512_set1_epi32(0xD800)), _mm512_set1_epi32(0x800));
+  }
+  return invalid == 0;
+}
+
+// the vectorized transcoders convert what they can of valid input and return the number of bytes consumed, leaving the
+// rest to the scalar code (the output must have room for the longest possible output)
+
+// for UTF-8 to UTF-16, the ends of the code points in the next 12 bytes select a shuffle that spreads six code points of
+// 1 or 2 bytes into 16-bit lanes (shuffles 0 to 63) or four of 1 to 3 bytes into 32-bit lanes (shuffles 64 to 144),
+// with the last byte of each code point first
+struct utf8_to_utf16_tables {
+  uint8_t index[4096][2]; // shuffle number (or 0xFF if there is none) and bytes consumed
+  uint8_t shuffles[145][16];
+};
+
+static utf8_to_utf16_tables build_utf8_to_utf16_tables() {
+  utf8_to_utf16_tables tables;
+  memset(tables.shuffles, 0x80, sizeof(tables.shuffles));
+  for (size_t ends = 0; ends < 4096; ends++) {
+    // find the sizes of the code points that end in the first 12 bytes
+    size_t sizes[12];
+    size_t count = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < 12; i++) {
+      if (ends&(1<<i)) {
+        sizes[count++] = i+1-start;
+        start = i+1;
+      }
+    }
+
+    // six code points of 1 or 2 bytes (the shuffle number has a bit per code point)
+    size_t six_short = count >= 6;
+    for (size_t i = 0; i < 6 && six_short; i++)
+      six_short = sizes[i] <= 2;
+    if (six_short) {
+      size_t shuffle = 0;
+      for (size_t i = 0; i < 6; i++)
+        shuffle |= (sizes[i]-1)<<i;
+      size_t pos = 0;
+      for (size_t i = 0; i < 6; i++) {
+        for (size_t j = 0; j < 2; j++)
+          tables.shuffles[shuffle][i*2+j] = j < sizes[i] ? pos+sizes[i]-1-j : 0x80;
+        pos += sizes[i];
+      }
+      tables.index[ends][0] = shuffle;
+      tables.index[ends][1] = pos;
+      continue;
+    }
+
+    // four code points of 1 to 3 bytes (the shuffle number has a base-3 digit per code point)
+    size_t four_medium = count >= 4;
+    for (size_t i = 0; i < 4 && four_medium; i++)
+      four_medium = sizes[i] <= 3;
+    if (four_medium) {
+      size_t shuffle = 0;
+      for (size_t i = 4; i > 0; i--)
+        shuffle = shuffle*3+sizes[i-1]-1;
+      shuffle += 64;
+      size_t pos = 0;
+      for (size_t i = 0; i < 4; i++) {
+        for (size_t j = 0; j < 4; j++)
+          tables.shuffles[shuffle][i*4+j] = j < sizes[i] ? pos+sizes[i]-1-j : 0x80;
+        pos += sizes[i];
+      }
+      tables.index[ends][0] = shuffle;
+      tables.index[ends][1] = pos;
+      continue;
+    }
+
+    // a four-byte code point comes too early
+    tables.index[ends][0] = 0xFF;
+    tables.index[ends][1] = 0;
+  }
+  return tables;
+}
+
+static const utf8_to_utf16_tables &get_utf8_to_utf16_tables() {
+  static const utf8_to_utf16_tables tables = build_utf8_to_utf16_tables();
+  return tables;
+}
+
+// for UTF-16 to UTF-8, each unit is expanded to its UTF-8 bytes in a lane, and a shuffle chosen by the sizes of the code
+// points packs them together
+struct utf16_to_utf8_tables {
+  uint8_t two_byte_shuffles[256][16];   // eight 16-bit lanes, indexed by which units are ASCII
+  uint8_t three_byte_shuffles[256][16]; // four 32-bit lanes, indexed by two bits per lane (size minus one)
+};
+
+static utf16_to_utf8_tables build_utf16_to_utf8_tables() {
+  utf16_to_utf8_tables tables;
+  memset(&tables, 0x80, sizeof(tables));
+  for (size_t ascii = 0; ascii < 256; ascii++) {
+    size_t pos = 0;
+    for (size_t i = 0; i < 8; i++) {
+      tables.two_byte_shuffles[ascii][pos++] = i*2;
+      if (!(ascii&(1<<i)))
+        tables.two_byte_shuffles[ascii][pos++] = i*2+1;
+    }
+  }
+  for (size_t sizes = 0; sizes < 256; sizes++) {
+    size_t pos = 0;
+    for (size_t i = 0; i < 4; i++) {
+      for (size_t j = 0; j <= ((sizes>>(i*2))&3) && j < 3; j++)
+        tables.three_byte_shuffles[sizes][pos++] = i*4+j;
+    }
+  }
+  return tables;
+}
+
+static const utf16_to_utf8_tables &get_utf16_to_utf8_tables() {
+  static const utf16_to_utf8_tables tables = build_utf16_to_utf8_tables();
+  return tables;
+}
+
+// move bit i of a 4-bit value to bit 2*i
+static const uint8_t spread_bits[16] = {0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15, 0x40, 0x41, 0x44, 0x45, 0x50, 0x51, 0x54, 0x55};
+
+// encode eight code points below U+0800 (in 16-bit lanes) in UTF-8, returning the number of bytes written (the store is 16 bytes)
+__attribute__((target("sse4.2,popcnt")))
+static inline size_t encode_utf8_two_byte_block_sse42(const __m128i units, uint8_t *output, const utf16_to_utf8_tables &tables) {
+  const __m128i ascii = _mm_cmplt_epi16(units, _mm_set1_epi16(0x80));
+  const uint32_t ascii_mask = _mm_movemask_epi8(_mm_packs_epi16(ascii, _mm_setzero_si128()));
+  const __m128i two_bytes = _mm_or_si128(
+    _mm_or_si128(_mm_srli_epi16(units, 6), _mm_set1_epi16(0xC0)),
+    _mm_slli_epi16(_mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x3F)), _mm_set1_epi16(0x80)), 8));
+  const __m128i bytes = _mm_blendv_epi8(two_bytes, units, ascii);
+  _mm_storeu_si128((__m128i *)output, _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i *)tables.two_byte_shuffles[ascii_mask])));
+  return 16-__builtin_popcount(ascii_mask);
+}
+
+// encode eight code points below U+10000 other than surrogates (in 16-bit lanes) in UTF-8, returning the number of bytes written (the stores reach 28 bytes)
+__attribute__((target("sse4.2,popcnt")))
+static inline size_t encode_utf8_three_byte_block_sse42(const __m128i units, uint8_t *output, const utf16_to_utf8_tables &tables) {
+  size_t output_pos = 0;
+  for (size_t half = 0; half < 2; half++) {
+    const __m128i code_points = _mm_cvtepu16_epi32(half ? _mm_srli_si128(units, 8) : units);
+    const __m128i two_bytes = _mm_or_si128(
+      _mm_or_si128(_mm_srli_epi32(code_points, 6), _mm_set1_epi32(0xC0)),
+      _mm_slli_epi32(_mm_or_si128(_mm_and_si128(code_points, _mm_set1_epi32(0x3F)), _mm_set1_epi32(0x80)), 8));
+    const __m128i three_bytes = _mm_or_si128(_mm_or_si128(
+      _mm_or_si128(_mm_srli_epi32(code_points, 12), _mm_set1_epi32(0xE0)),
+      _mm_slli_epi32(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(code_points, 6), _mm_set1_epi32(0x3F)), _mm_set1_epi32(0x80)), 8)),
+      _mm_slli_epi32(_mm_or_si128(_mm_and_si128(code_points, _mm_set1_epi32(0x3F)), _mm_set1_epi32(0x80)), 16));
+    const __m128i one_byte = _mm_cmplt_epi32(code_points, _mm_set1_epi32(0x80));
+    const __m128i up_to_two_bytes = _mm_cmplt_epi32(code_points, _mm_set1_epi32(0x800));
+    const __m128i bytes = _mm_blendv_epi8(_mm_blendv_epi8(three_bytes, two_bytes, up_to_two_bytes), code_points, one_byte);
+    const uint32_t at_least_two = ~_mm_movemask_ps(_mm_castsi128_ps(one_byte))&0xF;
+    const uint32_t three = ~_mm_movemask_ps(_mm_castsi128_ps(up_to_two_bytes))&0xF;
+    _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(bytes, _mm_loadu_si128((const __m128i *)tables.three_byte_shuffles[spread_bits[at_least_two]+spread_bits[three]])));
+    output_pos += 4+__builtin_popcount(at_least_two)+__builtin_popcount(three);
+  }
+  return output_pos;
+}
+
+// convert valid UTF-8 to UTF-16, stopping early only at a surrogate code point (which UTF-16 can't represent)
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_valid_utf8_to_utf16_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const utf8_to_utf16_tables &tables = get_utf8_to_utf16_tables();
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf16_swap_order : utf16_native_order));
+  size_t pos = 0;
+  size_t output_pos = 0;
+  while (pos+16 <= size) {
+    const __m128i input = _mm_loadu_si128((const __m128i *)(data+pos));
+
+    // ASCII
+    if (_mm_movemask_epi8(input) == 0) {
+      _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(_mm_unpacklo_epi8(input, _mm_setzero_si128()), byte_order));
+      _mm_storeu_si128((__m128i *)(output+output_pos+16), _mm_shuffle_epi8(_mm_unpackhi_epi8(input, _mm_setzero_si128()), byte_order));
+      pos += 16;
+      output_pos += 32;
+      continue;
+    }
+
+    // find the bytes that end a code point (the ones not followed by a continuation byte)
+    const uint32_t continuation = _mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(-64)));
+    const uint8_t *entry = tables.index[~(continuation>>1)&0xFFF];
+
+    // six code points of 1 or 2 bytes
+    if (entry[0] < 64) {
+      __m128i units = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i *)tables.shuffles[entry[0]]));
+      units = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x7F)), _mm_srli_epi16(_mm_and_si128(units, _mm_set1_epi16(0x1F00)), 2));
+      _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(units, byte_order));
+      pos += entry[1];
+      output_pos += 12;
+      continue;
+    }
+
+    // four code points of 1 to 3 bytes
+    if (entry[0] < 145) {
+      __m128i code_points = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i *)tables.shuffles[entry[0]]));
+      code_points = _mm_or_si128(_mm_or_si128(
+        _mm_and_si128(code_points, _mm_set1_epi32(0x7F)),
+        _mm_srli_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0x3F00)), 2)),
+        _mm_srli_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0x0F0000)), 4));
+      const __m128i surrogates = _mm_cmpeq_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0xF800)), _mm_set1_epi32(0xD800));
+      if (!_mm_testz_si128(surrogates, surrogates))
+        break;
+      _mm_storel_epi64((__m128i *)(output+output_pos), _mm_shuffle_epi8(_mm_packus_epi32(code_points, code_points), byte_order));
+      pos += entry[1];
+      output_pos += 8;
+      continue;
+    }
+
+    // a four-byte code point (a surrogate pair in UTF-16)
+    uint32_t code_point;
+    size_t char_size = codec<ENCODING_UTF8>::decode(data+pos, size-pos, code_point);
+    size_t unit_size = utf16_codec<big_endian>::encode(code_point, output+output_pos);
+    if (unit_size == 0)
+      break;
+    pos += char_size;
+    output_pos += unit_size;
+  }
+
+  // finish one code point at a time
+  while (pos < size) {
+    uint32_t code_point;
+    size_t char_size = codec<ENCODING_UTF8>::decode(data+pos, size-pos, code_point);
+    size_t unit_size = utf16_codec<big_endian>::encode(code_point, output+output_pos);
+    if (unit_size == 0)
+      break;
+    pos += char_size;
+    output_pos += unit_size;
+  }
+  output_size = output_pos;
+  return pos;
+}
+
+// convert valid UTF-8 to UTF-32, stopping early only at a surrogate code point (which UTF-32 can't represent)
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_valid_utf8_to_utf32_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const utf8_to_utf16_tables &tables = get_utf8_to_utf16_tables();
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf32_swap_order : utf32_native_order));
+  size_t pos = 0;
+  size_t output_pos = 0;
+  while (pos+16 <= size) {
+    const __m128i input = _mm_loadu_si128((const __m128i *)(data+pos));
+
+    // ASCII
+    if (_mm_movemask_epi8(input) == 0) {
+      _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(_mm_cvtepu8_epi32(input), byte_order));
+      _mm_storeu_si128((__m128i *)(output+output_pos+16), _mm_shuffle_epi8(_mm_cvtepu8_epi32(_mm_srli_si128(input, 4)), byte_order));
+      _mm_storeu_si128((__m128i *)(output+output_pos+32), _mm_shuffle_epi8(_mm_cvtepu8_epi32(_mm_srli_si128(input, 8)), byte_order));
+      _mm_storeu_si128((__m128i *)(output+output_pos+48), _mm_shuffle_epi8(_mm_cvtepu8_epi32(_mm_srli_si128(input, 12)), byte_order));
+      pos += 16;
+      output_pos += 64;
+      continue;
+    }
+
+    // find the bytes that end a code point (the ones not followed by a continuation byte)
+    const uint32_t continuation = _mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(-64)));
+    const uint8_t *entry = tables.index[~(continuation>>1)&0xFFF];
+
+    // six code points of 1 or 2 bytes
+    if (entry[0] < 64) {
+      __m128i units = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i *)tables.shuffles[entry[0]]));
+      units = _mm_or_si128(_mm_and_si128(units, _mm_set1_epi16(0x7F)), _mm_srli_epi16(_mm_and_si128(units, _mm_set1_epi16(0x1F00)), 2));
+      _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(_mm_cvtepu16_epi32(units), byte_order));
+      _mm_storeu_si128((__m128i *)(output+output_pos+16), _mm_shuffle_epi8(_mm_cvtepu16_epi32(_mm_srli_si128(units, 8)), byte_order));
+      pos += entry[1];
+      output_pos += 24;
+      continue;
+    }
+
+    // four code points of 1 to 3 bytes
+    if (entry[0] < 145) {
+      __m128i code_points = _mm_shuffle_epi8(input, _mm_loadu_si128((const __m128i *)tables.shuffles[entry[0]]));
+      code_points = _mm_or_si128(_mm_or_si128(
+        _mm_and_si128(code_points, _mm_set1_epi32(0x7F)),
+        _mm_srli_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0x3F00)), 2)),
+        _mm_srli_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0x0F0000)), 4));
+      const __m128i surrogates = _mm_cmpeq_epi32(_mm_and_si128(code_points, _mm_set1_epi32(0xF800)), _mm_set1_epi32(0xD800));
+      if (!_mm_testz_si128(surrogates, surrogates))
+        break;
+      _mm_storeu_si128((__m128i *)(output+output_pos), _mm_shuffle_epi8(code_points, byte_order));
+      pos += entry[1];
+      output_pos += 16;
+      continue;
+    }
+
+    // a four-byte code point comes too early, so convert one code point
+    uint32_t code_point;
+    size_t char_size = codec<ENCODING_UTF8>::decode(data+pos, size-pos, code_point);
+    size_t unit_size = utf32_codec<big_endian>::encode(code_point, output+output_pos);
+    if (unit_size == 0)
+      break;
+    pos += char_size;
+    output_pos += unit_size;
+  }
+
+  // finish one code point at a time
+  while (pos < size) {
+    uint32_t code_point;
+    size_t char_size = codec<ENCODING_UTF8>::decode(data+pos, size-pos, code_point);
+    size_t unit_size = utf32_codec<big_endian>::encode(code_point, output+output_pos);
+    if (unit_size == 0)
+      break;
+    pos += char_size;
+    output_pos += unit_size;
+  }
+  output_size = output_pos;
+  return pos;
+}
+
+// convert valid UTF-16 to UTF-8
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_valid_utf16_to_utf8_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const utf16_to_utf8_tables &tables = get_utf16_to_utf8_tables();
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf16_swap_order : utf16_native_order));
+  size_t pos = 0;
+  size_t output_pos = 0;
+
+  // leave 16 bytes of input for the scalar loop so that every store has room
+  while (pos+32 <= size) {
+    const __m128i units = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order);
+
+    // ASCII
+    if (_mm_testz_si128(units, _mm_set1_epi16((short)0xFF80))) {
+      _mm_storel_epi64((__m128i *)(output+output_pos), _mm_packus_epi16(units, units));
+      pos += 16;
+      output_pos += 8;
+      continue;
+    }
+
+    // one or two bytes per unit
+    if (_mm_testz_si128(units, _mm_set1_epi16((short)0xF800))) {
+      output_pos += encode_utf8_two_byte_block_sse42(units, output+output_pos, tables);
+      pos += 16;
+      continue;
+    }
+
+    // one to three bytes per unit
+    const __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xF800)), _mm_set1_epi16((short)0xD800));
+    if (_mm_testz_si128(surrogates, surrogates)) {
+      output_pos += encode_utf8_three_byte_block_sse42(units, output+output_pos, tables);
+      pos += 16;
+      continue;
+    }
+
+    // surrogate pairs: convert the block one code point at a time
+    const size_t block_end = pos+16;
+    while (pos < block_end) {
+      uint32_t code_point = 0;
+      pos += utf16_codec<big_endian>::decode(data+pos, size-pos, code_point);
+      output_pos += codec<ENCODING_UTF8>::encode(code_point, output+output_pos);
+    }
+  }
+
+  // finish one code point at a time
+  while (pos < size) {
+    uint32_t code_point;
+    size_t unit_size = utf16_codec<big_endian>::decode(data+pos, size-pos, code_point);
+    if (unit_size == 0)
+      break;
+    pos += unit_size;
+    output_pos += codec<ENCODING_UTF8>::encode(code_point, output+output_pos);
+  }
+  output_size = output_pos;
+  return pos;
+}
+
+// convert valid UTF-32 to UTF-8
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_valid_utf32_to_utf8_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const utf16_to_utf8_tables &tables = get_utf16_to_utf8_tables();
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf32_swap_order : utf32_native_order));
+  size_t pos = 0;
+  size_t output_pos = 0;
+
+  // the output is never longer than the input, so every store has room
+  while (pos+32 <= size) {
+    const __m128i low = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order);
+    const __m128i high = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos+16)), byte_order);
+    const __m128i both = _mm_or_si128(low, high);
+
+    // ASCII
+    if (_mm_testz_si128(both, _mm_set1_epi32(0xFFFFFF80))) {
+      const __m128i units = _mm_packus_epi32(low, high);
+      _mm_storel_epi64((__m128i *)(output+output_pos), _mm_packus_epi16(units, units));
+      pos += 32;
+      output_pos += 8;
+      continue;
+    }
+
+    // code points that fit in 16 bits are encoded like UTF-16 (there are no surrogates in valid UTF-32)
+    if (_mm_testz_si128(both, _mm_set1_epi32(0xFFFF0000))) {
+      const __m128i units = _mm_packus_epi32(low, high);
+      if (_mm_testz_si128(units, _mm_set1_epi16((short)0xF800)))
+        output_pos += encode_utf8_two_byte_block_sse42(units, output+output_pos, tables);
+      else
+        output_pos += encode_utf8_three_byte_block_sse42(units, output+output_pos, tables);
+      pos += 32;
+      continue;
+    }
+
+    // four-byte code points: convert the block one code point at a time
+    const size_t block_end = pos+32;
+    for (; pos < block_end; pos += 4)
+      output_pos += codec<ENCODING_UTF8>::encode(utf32_codec<big_endian>::read_unit(data+pos), output+output_pos);
+  }
+
+  // finish one code point at a time
+  while (pos < size) {
+    uint32_t code_point;
+    size_t unit_size = utf32_codec<big_endian>::decode(data+pos, size-pos, code_point);
+    if (unit_size == 0)
+      break;
+    pos += unit_size;
+    output_pos += codec<ENCODING_UTF8>::encode(code_point, output+output_pos);
+  }
+  output_size = output_pos;
+  return pos;
+}
+
+// convert UTF-8 to another encoding with one of the kernels above, validating one chunk at a time
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_utf8_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size, transcoder convert_valid) {
+  const validator validate = get_kernels().validate_utf8;
+  size_t pos = 0;
+  output_size = 0;
+  while (pos < size) {
+    // stop at the first chunk with an error
+    size_t end = get_chunk_end(data, pos, size, ENCODING_UTF8, TRANSCODE_CHUNK_SIZE);
+    size_t length, chunk_output_size;
+    if (!validate(data+pos, end-pos, length))
+      break;
+    size_t consumed = convert_valid(data+pos, end-pos, output+output_size, chunk_output_size);
+    pos += consumed;
+    output_size += chunk_output_size;
+    if (pos != end)
+      break;
+  }
+  return pos;
+}
+
+// the UTF-8 converters for the kernel table (a static function can't be a template argument before C++11)
+static size_t convert_utf8_to_utf16be_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  return convert_utf8_sse42(data, size, output, output_size, convert_valid_utf8_to_utf16_sse42<true>);
+}
+
+static size_t convert_utf8_to_utf16le_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  return convert_utf8_sse42(data, size, output, output_size, convert_valid_utf8_to_utf16_sse42<false>);
+}
+
+static size_t convert_utf8_to_utf32be_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  return convert_utf8_sse42(data, size, output, output_size, convert_valid_utf8_to_utf32_sse42<true>);
+}
+
+static size_t convert_utf8_to_utf32le_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  return convert_utf8_sse42(data, size, output, output_size, convert_valid_utf8_to_utf32_sse42<false>);
+}
+
+// convert UTF-16 to UTF-8, validating one chunk at a time
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_utf16_to_utf8_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const validator validate = big_endian ? get_kernels().validate_utf16be : get_kernels().validate_utf16le;
+  size_t pos = 0;
+  output_size = 0;
+  while (pos < size) {
+    // stop at the first chunk with an error
+    size_t end = get_chunk_end(data, pos, size, big_endian ? ENCODING_UTF16BE : ENCODING_UTF16LE, TRANSCODE_CHUNK_SIZE);
+    size_t length, chunk_output_size;
+    if (!validate(data+pos, end-pos, length))
+      break;
+    pos += convert_valid_utf16_to_utf8_sse42<big_endian>(data+pos, end-pos, output+output_size, chunk_output_size);
+    output_size += chunk_output_size;
+  }
+  return pos;
+}
+
+// convert UTF-32 to UTF-8, validating one chunk at a time
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static size_t convert_utf32_to_utf8_sse42(const uint8_t *data, size_t size, uint8_t *output, size_t &output_size) {
+  const validator validate = big_endian ? get_kernels().validate_utf32be : get_kernels().validate_utf32le;
+  size_t pos = 0;
+  output_size = 0;
+  while (pos < size) {
+    // stop at the first chunk with an error
+    size_t end = get_chunk_end(data, pos, size, big_endian ? ENCODING_UTF32BE : ENCODING_UTF32LE, TRANSCODE_CHUNK_SIZE);
+    size_t length, chunk_output_size;
+    if (!validate(data+pos, end-pos, length))
+      break;
+    pos += convert_valid_utf32_to_utf8_sse42<big_endian>(data+pos, end-pos, output+output_size, chunk_output_size);
+    output_size += chunk_output_size;
+  }
+  return pos;
+}
+
+// measure valid UTF-8 16 bytes at a time
+__attribute__((target("sse4.2,popcnt")))
+static void measure_utf8_sse42(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  // count the code points and the four-byte ones
+  size_t count = 0;
+  size_t four_byte_count = 0;
+  uint8_t padded[16];
+  for (size_t pos = 0; pos < size; pos += 16) {
+    // pad the last block with zeros (which count as code points)
+    const uint8_t *block = data+pos;
+    if (size-pos < 16) {
+      memset(padded, 0, sizeof(padded));
+      memcpy(padded, data+pos, size-pos);
+      block = padded;
+      count -= 16-(size-pos);
+    }
+    const __m128i input = _mm_loadu_si128((const __m128i *)block);
+    count += 16-__builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(input, _mm_set1_epi8(-64))));
+    four_byte_count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(input, _mm_set1_epi8((char)0xF0)), input)));
+  }
+
+  // a four-byte code point takes two units in UTF-16
+  utf8_size = size;
+  utf16_size = (count+four_byte_count)*2;
+}
+
+// measure valid UTF-16 8 code units at a time
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static void measure_utf16_sse42(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  // each unit takes 3 bytes in UTF-8, less one if it is below U+0800 or a surrogate, and less another if it is ASCII
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf16_swap_order : utf16_native_order));
+  utf8_size = 0;
+  size_t pos = 0;
+  for (; pos+16 <= size; pos += 16) {
+    const __m128i units = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order);
+    const __m128i high_bits = _mm_and_si128(units, _mm_set1_epi16((short)0xF800));
+    const uint32_t ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16((short)0xFF80)), _mm_setzero_si128()));
+    const uint32_t up_to_two_bytes = _mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, _mm_setzero_si128()));
+    const uint32_t surrogates = _mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, _mm_set1_epi16((short)0xD800)));
+    utf8_size += 24-(__builtin_popcount(ascii)+__builtin_popcount(up_to_two_bytes)+__builtin_popcount(surrogates))/2;
+  }
+
+  // finish with the scalar measurer
+  size_t tail_utf8_size, tail_utf16_size;
+  measure_utf16_scalar<big_endian>(data+pos, size-pos, tail_utf8_size, tail_utf16_size);
+  utf8_size += tail_utf8_size;
+  utf16_size = size;
+}
+
+// measure valid UTF-32 4 code units at a time
+template <bool big_endian>
+__attribute__((target("sse4.2,popcnt")))
+static void measure_utf32_sse42(const uint8_t *data, size_t size, size_t &utf8_size, size_t &utf16_size) {
+  // each code point takes 4 bytes in UTF-8, less one for each of U+10000, U+0800, and U+0080 it is below
+  const __m128i byte_order = _mm_loadu_si128((const __m128i *)(big_endian ? utf32_swap_order : utf32_native_order));
+  utf8_size = 0;
+  utf16_size = 0;
+  size_t pos = 0;
+  for (; pos+16 <= size; pos += 16) {
+    const __m128i code_points = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data+pos)), byte_order);
+    const uint32_t one_byte = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(code_points, _mm_set1_epi32(0x80)))));
+    const uint32_t up_to_two_bytes = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(code_points, _mm_set1_epi32(0x800)))));
+    const uint32_t up_to_three_bytes = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(code_points, _mm_set1_epi32(0x10000)))));
+    utf8_size += 16-one_byte-up_to_two_bytes-up_to_three_bytes;
+    utf16_size += 16-up_to_three_bytes*2;
+  }
+
+  // finish with the scalar measurer
+  size_t tail_utf8_size, tail_utf16_size;
+  measure_utf32_scalar<big_endian>(data+pos, size-pos, tail_utf8_size, tail_utf16_size);
+  utf8_size += tail_utf8_size;
+  utf16_size += tail_utf16_size;
+}
+
+#endif
+
+// pick the kernels for the instruction sets the CPU supports
+static kernel_table select_kernels() {
+  kernel_table kernels;
+  kernels.validate_ascii = validate_ascii_scalar;
+  kernels.validate_utf8 = validate_utf8_scalar;
+  kernels.validate_utf16be = validate_utf16_scalar<true>;
+  kernels.validate_utf16le = validate_utf16_scalar<false>;
+  kernels.validate_utf32be = validate_utf32_scalar<true>;
+  kernels.validate_utf32le = validate_utf32_scalar<false>;
+  kernels.measure_ascii = measure_ascii_scalar;
+  kernels.measure_utf8 = measure_utf8_scalar;
+  kernels.measure_utf16be = measure_utf16_scalar<true>;
+  kernels.measure_utf16le = measure_utf16_scalar<false>;
+  kernels.measure_utf32be = measure_utf32_scalar<true>;
+  kernels.measure_utf32le = measure_utf32_scalar<false>;
+  kernels.utf8_to_utf16be = NULL;
+  kernels.utf8_to_utf16le = NULL;
+  kernels.utf16be_to_utf8 = NULL;
+  kernels.utf16le_to_utf8 = NULL;
+  kernels.utf8_to_utf32be = NULL;
+  kernels.utf8_to_utf32le = NULL;
+  kernels.utf32be_to_utf8 = NULL;
+  kernels.utf32le_to_utf8 = NULL;
+  kernels.valid_utf8_to_utf16be = NULL;
+  kernels.valid_utf8_to_utf16le = NULL;
+  kernels.valid_utf16be_to_utf8 = NULL;
+  kernels.valid_utf16le_to_utf8 = NULL;
+  kernels.valid_utf8_to_utf32be = NULL;
+  kernels.valid_utf8_to_utf32le = NULL;
+  kernels.valid_utf32be_to_utf8 = NULL;
+  kernels.valid_utf32le_to_utf8 = NULL;
+  kernels.swap_utf16 = swap_units_scalar<2>;
+  kernels.swap_utf32 = swap_units_scalar<4>;
+  kernels.count_zeros = count_zeros_scalar;
+#ifdef UTF_SIMD_X86
+  __builtin_cpu_init();
+  if (!__builtin_cpu_supports("popcnt") || !__builtin_cpu_supports("sse4.2"))
+    return kernels;
+
+  // the transcoders and measurers only have an SSE4.2 version
+  kernels.measure_utf8 = measure_utf8_sse42;
+  kernels.measure_utf16be = measure_utf16_sse42<true>;
+  kernels.measure_utf16le = measure_utf16_sse42<false>;
+  kernels.measure_utf32be = measure_utf32_sse42<true>;
+  kernels.measure_utf32le = measure_utf32_sse42<false>;
+  kernels.utf8_to_utf16be = convert_utf8_to_utf16be_sse42;
+  kernels.utf8_to_utf16le = convert_utf8_to_utf16le_sse42;
+  kernels.utf16be_to_utf8 = convert_utf16_to_utf8_sse42<true>;
+  kernels.utf16le_to_utf8 = convert_utf16_to_utf8_sse42<false>;
+  kernels.utf8_to_utf32be = convert_utf8_to_utf32be_sse42;
+  kernels.utf8_to_utf32le = convert_utf8_to_utf32le_sse42;
+  kernels.utf32be_to_utf8 = convert_utf32_to_utf8_sse42<true>;
+  kernels.utf32le_to_utf8 = convert_utf32_to_utf8_sse42<false>;
+  kernels.valid_utf8_to_utf16be = convert_valid_utf8_to_utf16_sse42<true>;
+  kernels.valid_utf8_to_utf16le = convert_valid_utf8_to_utf16_sse42<false>;
+  kernels.valid_utf16be_to_utf8 = convert_valid_utf16_to_utf8_sse42<true>;
+  kernels.valid_utf16le_to_utf8 = convert_valid_utf16_to_utf8_sse42<false>;
+  kernels.valid_utf8_to_utf32be = convert_valid_utf8_to_utf32_sse42<true>;
+  kernels.valid_utf8_to_utf32le = convert_valid_utf8_to_utf32_sse42<false>;
+  kernels.valid_utf32be_to_utf8 = convert_valid_utf32_to_utf8_sse42<true>;
+  kernels.valid_utf32le_to_utf8 = convert_valid_utf32_to_utf8_sse42<false>;
+
+  // the byte swaps and zero counts gain nothing from AVX-512
+  if (__builtin_cpu_supports("avx2")) {
+    kernels.swap_utf16 = swap_units_avx2<2>;
+    kernels.swap_utf32 = swap_units_avx2<4>;
+    kernels.count_zeros = count_zeros_avx2;
+  } else {
+    kernels.swap_utf16 = swap_units_sse42<2>;
+    kernels.swap_utf32 = swap_units_sse42<4>;
+    kernels.count_zeros = count_zeros_sse42;
+  }
+
+  // the validators have a version for each tier
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    kernels.validate_ascii = validate_ascii_avx512;
+    kernels.validate_utf8 = validate_utf8_avx512;
+    kernels.validate_utf16be = validate_utf16_avx512<true>;
+    kernels.validate_utf16le = validate_utf16_avx512<false>;
+    kernels.validate_utf32be = validate_utf32_avx512<true>;
+    kernels.validate_utf32le = validate_utf32_avx512<false>;
+  } else if (__builtin_cpu_supports("avx2")) {
+    kernels.validate_ascii = validate_ascii_avx2;
+    kernels.validate_utf8 = validate_utf8_avx2;
+    kernels.validate_utf16be = validate_utf16_avx2<true>;
+    kernels.validate_utf16le = validate_utf16_avx2<false>;
+    kernels.validate_utf32be = validate_utf32_avx2<true>;
+    kernels.validate_utf32le = validate_utf32_avx2<false>;
+  } else {
+    kernels.validate_ascii = validate_ascii_sse42;
+    kernels.validate_utf8 = validate_utf8_sse42;
+    kernels.validate_utf16be = validate_utf16_sse42<true>;
+    kernels.validate_utf16le = validate_utf16_sse42<false>;
+    kernels.validate_utf32be = validate_utf32_sse42<true>;
+    kernels.validate_utf32le = validate_utf32_sse42<false>;
+  }
+#endif
+  return kernels;
+}
+
+// the kernels are chosen once, on first use
+static const kernel_table &get_kernels() {
+  static const kernel_table kernels = select_kernels();
+  return kernels;
+}
+
+// get the bulk transcoder between two encodings, or NULL if there isn't one
+static transcoder get_transcoder(encoding_type input_encoding, encoding_type output_encoding) {
+  const kernel_table &kernels = get_kernels();
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF16BE)
+    return kernels.utf8_to_utf16be;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF16LE)
+    return kernels.utf8_to_utf16le;
+  if (input_encoding == ENCODING_UTF16BE && output_encoding == ENCODING_UTF8)
+    return kernels.utf16be_to_utf8;
+  if (input_encoding == ENCODING_UTF16LE && output_encoding == ENCODING_UTF8)
+    return kernels.utf16le_to_utf8;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF32BE)
+    return kernels.utf8_to_utf32be;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF32LE)
+    return kernels.utf8_to_utf32le;
+  if (input_encoding == ENCODING_UTF32BE && output_encoding == ENCODING_UTF8)
+    return kernels.utf32be_to_utf8;
+  if (input_encoding == ENCODING_UTF32LE && output_encoding == ENCODING_UTF8)
+    return kernels.utf32le_to_utf8;
+  return NULL;
+}
+
+// get the bulk transcoder between two encodings for input that is known to be valid, or NULL if there is none
+static transcoder get_valid_transcoder(encoding_type input_encoding, encoding_type output_encoding) {
+  const kernel_table &kernels = get_kernels();
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF16BE)
+    return kernels.valid_utf8_to_utf16be;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF16LE)
+    return kernels.valid_utf8_to_utf16le;
+  if (input_encoding == ENCODING_UTF16BE && output_encoding == ENCODING_UTF8)
+    return kernels.valid_utf16be_to_utf8;
+  if (input_encoding == ENCODING_UTF16LE && output_encoding == ENCODING_UTF8)
+    return kernels.valid_utf16le_to_utf8;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF32BE)
+    return kernels.valid_utf8_to_utf32be;
+  if (input_encoding == ENCODING_UTF8 && output_encoding == ENCODING_UTF32LE)
+    return kernels.valid_utf8_to_utf32le;
+  if (input_encoding == ENCODING_UTF32BE && output_encoding == ENCODING_UTF8)
+    return kernels.valid_utf32be_to_utf8;
+  if (input_encoding == ENCODING_UTF32LE && output_encoding == ENCODING_UTF8)
+    return kernels.valid_utf32le_to_utf8;
+  return NULL;
+}
+
+// get the bulk validator for an encoding, or NULL if the encoding is unknown
+static validator get_validator(encoding_type encoding) {
+  const kernel_table &kernels = get_kernels();
+  if (encoding == ENCODING_ASCII)
+    return kernels.validate_ascii;
+  if (encoding == ENCODING_UTF8)
+    return kernels.validate_utf8;
+  if (encoding == ENCODING_UTF16BE)
+    return kernels.validate_utf16be;
+  if (encoding == ENCODING_UTF16LE)
+    return kernels.validate_utf16le;
+  if (encoding == ENCODING_UTF32BE)
+    return kernels.validate_utf32be;
+  if (encoding == ENCODING_UTF32LE)
+    return kernels.validate_utf32le;
+  return NULL;
+}
+
+// get the bulk measurer for an encoding, or NULL if the encoding is unknown
+static measurer get_measurer(encoding_type encoding) {
+  const kernel_table &kernels = get_kernels();
+  if (encoding == ENCODING_ASCII)
+    return kernels.measure_ascii;
+  if (encoding == ENCODING_UTF8)
+    return kernels.measure_utf8;
+  if (encoding == ENCODING_UTF16BE)
+    return kernels.measure_utf16be;
+  if (encoding == ENCODING_UTF16LE)
+    return kernels.measure_utf16le;
+  if (encoding == ENCODING_UTF32BE)
+    return kernels.measure_utf32be;
+  if (encoding == ENCODING_UTF32LE)
+    return kernels.measure_utf32le;
+  return NULL;
+}
+
+// determine whether converting between two encodings keeps the code units, except perhaps for their byte order
+static bool has_same_units(encoding_type input_encoding, encoding_type output_encoding) {
+  if (input_encoding == ENCODING_ASCII)
+    return output_encoding == ENCODING_ASCII || output_encoding == ENCODING_UTF8;
+  if (input_encoding == ENCODING_UTF8)
+    return output_encoding == ENCODING_UTF8;
+  if (input_encoding == ENCODING_UTF16BE || input_encoding == ENCODING_UTF16LE)
+    return output_encoding == ENCODING_UTF16BE || output_encoding == ENCODING_UTF16LE;
+  if (input_encoding == ENCODING_UTF32BE || input_encoding == ENCODING_UTF32LE)
+    return output_encoding == ENCODING_UTF32BE || output_encoding == ENCODING_UTF32LE;
+  return false;
+}
+
+// copy the code units of a string to an encoding with the same units, swapping their bytes if the byte order differs,
+// and return the number of bytes copied (each chunk is validated just before it is copied, and the copy stops at the
+// first chunk with an error)
+static size_t copy_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, uint8_t *output) {
+  const validator validate = get_validator(input_encoding);
+  swapper swap = NULL;
+  if (input_encoding != output_encoding) {
+    if (input_encoding == ENCODING_UTF16BE || input_encoding == ENCODING_UTF16LE)
+      swap = get_kernels().swap_utf16;
+    if (input_encoding == ENCODING_UTF32BE || input_encoding == ENCODING_UTF32LE)
+      swap = get_kernels().swap_utf32;
+  }
+  size_t pos = 0;
+  while (pos < size) {
+    size_t end = get_chunk_end(data, pos, size, input_encoding, TRANSCODE_CHUNK_SIZE);
+    size_t length;
+    if (!validate(data+pos, end-pos, length))
+      break;
+    if (swap)
+      swap(data+pos, end-pos, output+pos);
+    else
+      memcpy(output+pos, data+pos, end-pos);
+    pos = end;
+  }
+  return pos;
+}
+
+// make sure both encodings are known
+static error_type check_encodings(encoding_type input_encoding, encoding_type output_encoding) {
+  if (get_validator(input_encoding) == NULL)
+    return ERROR_UNKNOWN_INPUT_ENCODING;
+  if (get_validator(output_encoding) == NULL)
+    return ERROR_UNKNOWN_OUTPUT_ENCODING;
+  return ERROR_NONE;
+}
+
+// find the offset of the first malformed code point in a string, or size if there is none (only for error paths)
+static size_t find_malformed(const uint8_t *data, size_t size, encoding_type encoding) {
+  // skip the valid chunks in bulk
+  const validator validate = get_validator(encoding);
+  size_t pos = 0;
+  while (pos < size) {
+    size_t end = get_chunk_end(data, pos, size, encoding, SCRATCH_CHUNK_SIZE);
+    size_t length;
+    if (!validate(data+pos, end-pos, length))
+      break;
+    pos = end;
+  }
+
+  // and decode the one with the error one code point at a time
+  while (pos < size) {
+    uint32_t code_point;
+    size_t char_size = decode_char(data+pos, size-pos, encoding, code_point);
+    if (char_size == 0)
+      return pos;
+    pos += char_size;
+  }
+  return size;
+}
+
+// report a code point at pos that can't be encoded, unless the input is malformed after it (malformed input takes
+// precedence)
+static status get_encode_status(const uint8_t *data, size_t pos, size_t size, encoding_type input_encoding) {
+  size_t malformed = pos+find_malformed(data+pos, size-pos, input_encoding);
+  if (malformed < size)
+    return make_status(ERROR_MALFORMED_INPUT, malformed);
+  return make_status(ERROR_UNENCODABLE_CODE_POINT, pos);
+}
+
+// get the BOM of an encoding (ASCII has none)
+static const char *get_bom(encoding_type encoding, size_t &size) {
+  size = 0;
+  if (encoding == ENCODING_UTF8) {
+    size = 3;
+    return "\xEF\xBB\xBF";
+  }
+  if (encoding == ENCODING_UTF16BE) {
+    size = 2;
+    return "\xFE\xFF";
+  }
+  if (encoding == ENCODING_UTF16LE) {
+    size = 2;
+    return "\xFF\xFE";
+  }
+  if (encoding == ENCODING_UTF32BE) {
+    size = 4;
+    return "\x00\x00\xFE\xFF";
+  }
+  if (encoding == ENCODING_UTF32LE) {
+    size = 4;
+    return "\xFF\xFE\x00\x00";
+  }
+  return "";
+}
+
+// get the size of the BOM at the start of a string, or 0 if there isn't one
+static size_t get_bom_size(const uint8_t *data, size_t size, encoding_type encoding) {
+  size_t bom_size;
+  const char *bom = get_bom(encoding, bom_size);
+  if (bom_size == 0 || size < bom_size || memcmp(data, bom, bom_size) != 0)
+    return 0;
+  return bom_size;
+}
+
+// convert code points one at a time from pos, with both encodings known at compile time (output_size is the number of
+// bytes already written, and is updated as more are written)
+template <encoding_type input_encoding, encoding_type output_encoding>
+static status convert_code_points(const uint8_t *data, size_t size, size_t pos, uint8_t *output, size_t &output_size) {
+  // validate, decode, and encode each code point in a single pass
+  while (pos < size) {
+    uint32_t code_point;
+    size_t char_size = codec<input_encoding>::decode(data+pos, size-pos, code_point);
+    if (char_size == 0)
+      return make_status(ERROR_MALFORMED_INPUT, pos);
+    size_t unit_size = codec<output_encoding>::encode(code_point, output+output_size);
+    if (unit_size == 0)
+      return get_encode_status(data, pos, size, input_encoding);
+    pos += char_size;
+    output_size += unit_size;
+  }
+  return make_status(ERROR_NONE, size);
+}
+
+// convert code points from pos to end (or just past it, to finish a code point), with both encodings known at compile
+// time, replacing each maximal malformed sequence and each code point that can't be encoded with U+FFFD, or '?' if the
+// output can't encode that either, and return where it stopped (replacements is increased by the number made; valid
+// code points are copied as they are when the encodings are the same)
+template <encoding_type input_encoding, encoding_type output_encoding>
+static size_t replace_code_points(const uint8_t *data, size_t size, size_t pos, size_t end, uint8_t *output, size_t &output_size, size_t &replacements) {
+  while (pos < end) {
+    uint32_t code_point;
+    size_t unit_size = 0;
+    size_t char_size = codec<input_encoding>::decode(data+pos, size-pos, code_point);
+    if (char_size == 0)
+      char_size = codec<input_encoding>::get_malformed_size(data+pos, size-pos);
+    else if (input_encoding == output_encoding) {
+      memcpy(output+output_size, data+pos, char_size);
+      unit_size = char_size;
+    } else
+      unit_size = codec<output_encoding>::encode(code_point, output+output_size);
+    if (unit_size == 0) {
+      unit_size = codec<output_encoding>::encode(0xFFFD, output+output_size);
+      if (unit_size == 0) {
+        output[output_size] = '?';
+        unit_size = 1;
+      }
+      ++replacements;
+    }
+    pos += char_size;
+    output_size += unit_size;
+  }
+  return pos;
+}
+
+// add up the sizes of valid code points in another encoding from pos to end, with both encodings known at compile
+// time, and return the position of the first one that can't be encoded, or end
+template <encoding_type input_encoding, encoding_type output_encoding>
+static size_t measure_code_points(const uint8_t *data, size_t pos, size_t end, size_t &output_size) {
+  while (pos < end) {
+    uint32_t code_point = 0;
+    size_t char_size = codec<input_encoding>::decode(data+pos, end-pos, code_point);
+    size_t unit_size = codec<output_encoding>::get_encoded_size(code_point);
+    if (unit_size == 0)
+      break;
+    pos += char_size;
+    output_size += unit_size;
+  }
+  return pos;
+}
+
+// the code point loops for a pair of encodings, chosen once per call
+typedef status (*code_point_converter)(const uint8_t *data, size_t size, size_t pos, uint8_t *output, size_t &output_size);
+typedef size_t (*code_point_measurer)(const uint8_t *data, size_t pos, size_t end, size_t &output_size);
+typedef size_t (*code_point_replacer)(const uint8_t *data, size_t size, size_t pos, size_t end, uint8_t *output, size_t &output_size, size_t &replacements);
+struct code_point_loops {
+  code_point_converter convert;
+  code_point_measurer measure;
+  code_point_replacer replace;
+};
+
+template <encoding_type input_encoding, encoding_type output_encoding>
+static code_point_loops make_code_point_loops() {
+  code_point_loops loops;
+  loops.convert = convert_code_points<input_encoding, output_encoding>;
+  loops.measure = measure_code_points<input_encoding, output_encoding>;
+  loops.replace = replace_code_points<input_encoding, output_encoding>;
+  return loops;
+}
+
+template <encoding_type input_encoding>
+static code_point_loops get_code_point_loops(encoding_type output_encoding) {
+  if (output_encoding == ENCODING_ASCII)
+    return make_code_point_loops<input_encoding, ENCODING_ASCII>();
+  if (output_encoding == ENCODING_UTF8)
+    return make_code_point_loops<input_encoding, ENCODING_UTF8>();
+  if (output_encoding == ENCODING_UTF16BE)
+    return make_code_point_loops<input_encoding, ENCODING_UTF16BE>();
+  if (output_encoding == ENCODING_UTF16LE)
+    return make_code_point_loops<input_encoding, ENCODING_UTF16LE>();
+  if (output_encoding == ENCODING_UTF32BE)
+    return make_code_point_loops<input_encoding, ENCODING_UTF32BE>();
+  return make_code_point_loops<input_encoding, ENCODING_UTF32LE>();
+}
+
+// get the code point loops for two known encodings
+static code_point_loops get_code_point_loops(encoding_type input_encoding, encoding_type output_encoding) {
+  if (input_encoding == ENCODING_ASCII)
+    return get_code_point_loops<ENCODING_ASCII>(output_encoding);
+  if (input_encoding == ENCODING_UTF8)
+    return get_code_point_loops<ENCODING_UTF8>(output_encoding);
+  if (input_encoding == ENCODING_UTF16BE)
+    return get_code_point_loops<ENCODING_UTF16BE>(output_encoding);
+  if (input_encoding == ENCODING_UTF16LE)
+    return get_code_point_loops<ENCODING_UTF16LE>(output_encoding);
+  if (input_encoding == ENCODING_UTF32BE)
+    return get_code_point_loops<ENCODING_UTF32BE>(output_encoding);
+  return get_code_point_loops<ENCODING_UTF32LE>(output_encoding);
+}
+
+// convert a string to another encoding in a buffer with room for get_max_output_size bytes (output_size is the number
+// of bytes written, and the offset of an error is relative to data)
+static status convert_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, uint8_t *output, size_t &output_size) {
+  // convert in bulk where possible (the scalar loop below picks up any remainder and reports errors)
+  size_t pos = 0;
+  size_t output_pos = 0;
+  if (has_same_units(input_encoding, output_encoding)) {
+    pos = copy_units(data, size, input_encoding, output_encoding, output);
+    output_pos = pos;
+  } else {
+    transcoder transcode = get_transcoder(input_encoding, output_encoding);
+    if (transcode)
+      pos = transcode(data, size, output, output_pos);
+  }
+
+  // and convert any remainder one code point at a time
+  output_size = output_pos;
+  if (pos == size)
+    return make_status(ERROR_NONE, size);
+  return get_code_point_loops(input_encoding, output_encoding).convert(data, size, pos, output, output_size);
+}
+
+// the version of convert_units for a string that is known to be valid, which converts it in bulk without validating it
+// (the code points left to the scalar loop are still decoded one at a time, and may still be unencodable)
+static status convert_valid_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, uint8_t *output, size_t &output_size) {
+  size_t pos = 0;
+  size_t output_pos = 0;
+  if (has_same_units(input_encoding, output_encoding)) {
+    swapper swap = NULL;
+    if (input_encoding != output_encoding && (input_encoding == ENCODING_UTF16BE || input_encoding == ENCODING_UTF16LE))
+      swap = get_kernels().swap_utf16;
+    if (input_encoding != output_encoding && (input_encoding == ENCODING_UTF32BE || input_encoding == ENCODING_UTF32LE))
+      swap = get_kernels().swap_utf32;
+    if (swap)
+      swap(data, size, output);
+    else
+      memcpy(output, data, size);
+    pos = size;
+    output_pos = size;
+  } else {
+    // the usual transcoders are still correct for valid input when there's nothing faster
+    transcoder transcode = get_valid_transcoder(input_encoding, output_encoding);
+    if (!transcode)
+      transcode = get_transcoder(input_encoding, output_encoding);
+    if (transcode)
+      pos = transcode(data, size, output, output_pos);
+  }
+
+  // and convert any remainder one code point at a time
+  output_size = output_pos;
+  if (pos == size)
+    return make_status(ERROR_NONE, size);
+  return get_code_point_loops(input_encoding, output_encoding).convert(data, size, pos, output, output_size);
+}
+
+// find the exact size of a string converted to another encoding (the offset of an error is relative to data)
+static status measure_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, size_t &output_size) {
+  const validator validate = get_validator(input_encoding);
+  const measurer measure = get_measurer(input_encoding);
+  const code_point_measurer measure_each = get_code_point_loops(input_encoding, output_encoding).measure;
+  output_size = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    // validate and count one chunk at a time
+    size_t end = get_chunk_end(data, pos, size, input_encoding, TRANSCODE_CHUNK_SIZE);
+    size_t length;
+    if (!validate(data+pos, end-pos, length))
+      return make_status(ERROR_MALFORMED_INPUT, pos+find_malformed(data+pos, end-pos, input_encoding));
+
+    // find the size from the number of code points, or from the sizes of the code points in UTF-8 or UTF-16
+    size_t utf8_size, utf16_size;
+    if (has_same_units(input_encoding, output_encoding)) {
+      output_size += end-pos;
+      pos = end;
+      continue;
+    }
+    measure(data+pos, end-pos, utf8_size, utf16_size);
+    if (output_encoding != ENCODING_ASCII || utf8_size == length) {
+      if (output_encoding == ENCODING_ASCII)
+        output_size += length;
+      if (output_encoding == ENCODING_UTF8)
+        output_size += utf8_size;
+      if (output_encoding == ENCODING_UTF16BE || output_encoding == ENCODING_UTF16LE)
+        output_size += utf16_size;
+      if (output_encoding == ENCODING_UTF32BE || output_encoding == ENCODING_UTF32LE)
+        output_size += length*4;
+      pos = end;
+      continue;
+    }
+
+    // otherwise add up the sizes of the code points of the chunk
+    pos = measure_each(data, pos, end, output_size);
+    if (pos < end)
+      return get_encode_status(data, pos, size, input_encoding);
+  }
+  return make_status(ERROR_NONE, size);
+}
+
+// get the most bytes that converting size bytes from one encoding to another can produce when malformed input and code
+// points that can't be encoded are replaced (each replacement stands for at least one input code unit, and a partial
+// code unit at the end may get one too)
+static size_t get_max_replaced_size(size_t size, encoding_type input_encoding, encoding_type output_encoding) {
+  size_t input_unit = 1;
+  if (input_encoding == ENCODING_UTF16BE || input_encoding == ENCODING_UTF16LE)
+    input_unit = 2;
+  if (input_encoding == ENCODING_UTF32BE || input_encoding == ENCODING_UTF32LE)
+    input_unit = 4;
+  size_t replacement_size = 1;
+  if (output_encoding == ENCODING_UTF8)
+    replacement_size = 3;
+  if (output_encoding == ENCODING_UTF16BE || output_encoding == ENCODING_UTF16LE)
+    replacement_size = 2;
+  if (output_encoding == ENCODING_UTF32BE || output_encoding == ENCODING_UTF32LE)
+    replacement_size = 4;
+  size_t most = get_max_output_size(size, input_encoding, output_encoding);
+  if (most < size/input_unit*replacement_size)
+    most = size/input_unit*replacement_size;
+  return most+replacement_size;
+}
+
+// convert a string to another encoding in a buffer with room for get_max_replaced_size bytes, replacing malformed input
+// and code points that can't be encoded, and return the number of replacements (the valid chunks are converted in
+// bulk, and only the chunks with errors one code point at a time)
+static size_t replace_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, uint8_t *output, size_t &output_size) {
+  const bool same_units = has_same_units(input_encoding, output_encoding);
+  const transcoder transcode = same_units ? NULL : get_transcoder(input_encoding, output_encoding);
+  const code_point_replacer replace = get_code_point_loops(input_encoding, output_encoding).replace;
+  size_t replacements = 0;
+  size_t pos = 0;
+  output_size = 0;
+  while (pos < size) {
+    // convert in bulk up to the first chunk with an error
+    size_t converted = 0;
+    size_t converted_size = 0;
+    if (same_units) {
+      converted = copy_units(data+pos, size-pos, input_encoding, output_encoding, output+output_size);
+      converted_size = converted;
+    } else if (transcode)
+      converted = transcode(data+pos, size-pos, output+output_size, converted_size);
+    pos += converted;
+    output_size += converted_size;
+
+    // and that chunk one code point at a time
+    if (pos < size)
+      pos = replace(data, size, pos, get_chunk_end(data, pos, size, input_encoding, TRANSCODE_CHUNK_SIZE), output, output_size, replacements);
+  }
+  return replacements;
+}
+
+// get the size of the start of a code point at the end of a string that is cut off there, or 0 if the string ends
+// with a whole code point (or a malformed one)
+static size_t get_incomplete_size(const uint8_t *data, size_t size, encoding_type encoding) {
+  // UTF-8: a lead byte followed by fewer continuation bytes than it calls for
+  if (encoding == ENCODING_UTF8) {
+    for (size_t i = 1; i <= 3 && i <= size; i++) {
+      uint8_t byte = data[size-i];
+      if ((byte&0xC0) == 0x80)
+        continue;
+      size_t char_size = byte >= 0xF0 ? 4 : byte >= 0xE0 ? 3 : byte >= 0xC0 ? 2 : 1;
+      return char_size > i ? i : 0;
+    }
+    return 0;
+  }
+
+  // UTF-16: part of a code unit, or a high surrogate (and maybe part of a code unit)
+  if (encoding == ENCODING_UTF16BE || encoding == ENCODING_UTF16LE) {
+    size_t partial = size%2;
+    if (size-partial >= 2 && (data[size-partial-(encoding == ENCODING_UTF16BE ? 2 : 1)]&0xFC) == 0xD8)
+      return partial+2;
+    return partial;
+  }
+
+  // UTF-32: part of a code unit
+  if (encoding == ENCODING_UTF32BE || encoding == ENCODING_UTF32LE)
+    return size%4;
+  return 0;
+}
+
+// convert a string to another encoding, appending the result to output (which is left as it was if there is an error)
+static status append_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, string &output) {
+  size_t start = output.size();
+  output.resize(start+get_max_output_size(size, input_encoding, output_encoding));
+  size_t output_size;
+  status result = convert_units(data, size, input_encoding, output_encoding, (uint8_t *)&output[0]+start, output_size);
+  output.resize(result.error == ERROR_NONE ? start+output_size : start);
+  return result;
+}
+
+// convert a valid string whose converted size is known to fit in output_capacity bytes, one chunk at a time, through a
+// small scratch buffer once the rest of the buffer is too small for the longest possible output of a chunk (returns the
+// number of bytes written, and never writes past output_capacity)
+static size_t convert_measured_units(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, uint8_t *output, size_t output_capacity) {
+  size_t pos = 0;
+  size_t output_pos = 0;
+  while (pos < size) {
+    size_t end = get_chunk_end(data, pos, size, input_encoding, TRANSCODE_CHUNK_SIZE);
+    size_t chunk_output_size;
+    if (output_capacity-output_pos >= get_max_output_size(end-pos, input_encoding, output_encoding))
+      convert_units(data+pos, end-pos, input_encoding, output_encoding, output+output_pos, chunk_output_size);
+    else {
+      uint8_t scratch[SCRATCH_CHUNK_SIZE*4];
+      end = get_chunk_end(data, pos, size, input_encoding, SCRATCH_CHUNK_SIZE);
+      convert_units(data+pos, end-pos, input_encoding, output_encoding, scratch, chunk_output_size);
+      memcpy(output+output_pos, scratch, chunk_output_size);
+    }
+    pos = end;
+    output_pos += chunk_output_size;
+  }
+  return output_pos;
+}
+
+// the smallest piece of a string worth handing to a thread of its own
+#define PARALLEL_CHUNK_SIZE (1<<20)
+
+// a piece of a string for one thread to process
+struct parallel_task {
+  // the piece (from start to end of data) and the encodings
+  const uint8_t *data;
+  size_t start;
+  size_t end;
+  encoding_type input_encoding;
+  encoding_type output_encoding;
+
+  // where the converted piece goes and its size, and the number of code points
+  uint8_t *output;
+  size_t output_size;
+  size_t length;
+
+  // whether the piece has an error
+  bool failed;
+};
+
+// find the number of threads to use for a string, given the number asked for (0 for one per core)
+static size_t get_thread_count(size_t size, unsigned int thread_count) {
+#ifdef UTF_THREADS
+  size_t count = thread_count > 0 ? thread_count : thread::hardware_concurrency();
+#else
+  size_t count = 1;
+  (void)thread_count;
+#endif
+  size_t most = size/PARALLEL_CHUNK_SIZE;
+  if (count > most)
+    count = most;
+  return count > 0 ? count : 1;
+}
+
+// split a string into a piece per thread, without splitting a code point between pieces (if it is valid there)
+static vector<parallel_task> split_tasks(const uint8_t *data, size_t size, encoding_type input_encoding, encoding_type output_encoding, size_t thread_count) {
+  // round the pieces up to a whole number of code units
+  size_t chunk_size = (size+thread_count-1)/thread_count;
+  chunk_size += (4-chunk_size%4)%4;
+  vector<parallel_task> tasks;
+  size_t pos = 0;
+  while (pos < size) {
+    parallel_task task;
+    task.data = data;
+    task.start = pos;
+    task.end = get_chunk_end(data, pos, size, input_encoding, chunk_size);
+    task.input_encoding = input_encoding;
+    task.output_encoding = output_encoding;
+    task.output = NULL;
+    task.output_size = 0;
+    task.length = 0;
+    task.failed = false;
+    tasks.push_back(task);
+    pos = task.end;
+  }
+  return tasks;
+}
+
+// run a function on every task, on a thread each except for the first, which runs on the calling thread (if a thread
+// can't be started, its task runs on the calling thread too)
+template <typename task_type>
+static void run_tasks(void (*run)(task_type *), vector<task_type> &tasks) {
+#ifdef UTF_THREADS
+  vector<thread> threads;
+  for (size_t i = 1; i < tasks.size(); i++) {
+  #ifdef UTF_EXCEPTIONS
+    try {
+      threads.push_back(thread(run, &tasks[i]));
+    } catch (...) {
+      run(&tasks[i]);
+    }
+  #else
+    threads.push_back(thread(run, &tasks[i]));
+  #endif
+  }
+  if (!tasks.empty())
+    run(&tasks[0]);
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+#else
+  for (size_t i = 0; i < tasks.size(); i++)
+    run(&tasks[i]);
+#endif
+}
+
+// find the start of the first piece with an error, or the end of the string if there is none (the pieces before it are
+// valid, so it starts on a code point boundary and the error a single pass would report is the first one after it,
+// although a piece may report an error that isn't there if malformed input near its end made it split a code point)
+static size_t get_failed_start(const vector<parallel_task> &tasks, size_t size) {
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i].failed)
+      return tasks[i].start;
+  }
+  return size;
+}
+
+// validate and count the code points of a piece
+static void validate_task(parallel_task *task) {
+  task->failed = !get_validator(task->input_encoding)(task->data+task->start, task->end-task->start, task->length);
+}
+
+// find the converted size of a piece
+static void measure_task(parallel_task *task) {
+  task->failed = measure_units(task->data+task->start, task->end-task->start, task->input_encoding, task->output_encoding, task->output_size).error != ERROR_NONE;
+}
+
+// convert a valid piece into its place in the output
+static void convert_task(parallel_task *task) {
+  convert_measured_units(task->data+task->start, task->end-task->start, task->input_encoding, task->output_encoding, task->output, task->output_size);
+}
+
+// convert strings first to last of a column as if by convert_encoding, appending them to output and setting
+// output_offsets[0] to output_offsets[last-first] to where each starts and where the last one ends (output is left as it
+// was if there is an error, and the offset of an error is from data)
+static status convert_strings(const uint8_t *data, const size_t *offsets, size_t first, size_t last, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, size_t *output_offsets) {
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // make room for the longest possible output of all the strings at once
+  size_t start = output.size();
+  output.resize(start+(last-first)*bom_size+get_max_output_size(offsets[last]-offsets[first], input_encoding, output_encoding));
+  uint8_t *result = (uint8_t *)&output[0];
+  size_t output_pos = start;
+  for (size_t i = first; i < last; i++) {
+    // skip the BOM in the input if present, and add the one in the output if necessary
+    output_offsets[i-first] = output_pos;
+    size_t pos = offsets[i]+get_bom_size(data+offsets[i], offsets[i+1]-offsets[i], input_encoding);
+    memcpy(result+output_pos, bom, bom_size);
+    output_pos += bom_size;
+
+    // and convert the string
+    size_t output_size;
+    status converted = convert_units(data+pos, offsets[i+1]-pos, input_encoding, output_encoding, result+output_pos, output_size);
+    if (converted.error != ERROR_NONE) {
+      output.resize(start);
+      return make_status(converted.error, pos+converted.offset);
+    }
+    output_pos += output_size;
+  }
+  output_offsets[last-first] = output_pos;
+  output.resize(output_pos);
+  return make_status(ERROR_NONE, offsets[last]);
+}
+
+// some of the strings of a column for one thread to convert
+struct batch_task {
+  // the column, the strings to convert, and the encodings
+  const uint8_t *data;
+  const size_t *offsets;
+  size_t first;
+  size_t last;
+  encoding_type input_encoding;
+  encoding_type output_encoding;
+  bool include_bom;
+
+  // the converted strings and where each starts in output, and the result
+  string output;
+  vector<size_t> output_offsets;
+  status result;
+};
+
+// convert the strings of a task
+static void convert_batch_task(batch_task *task) {
+  task->output_offsets.resize(task->last-task->first+1);
+  task->result = convert_strings(task->data, task->offsets, task->first, task->last, task->input_encoding, task->output_encoding, task->include_bom, task->output, &task->output_offsets[0]);
+}
+
+// the number of bytes in each window that detect_encodings samples from the rest of a long string
+#define DETECT_WINDOW_SIZE 4096
+
+// the encodings that detect_encodings considers, in the order it ranks them when they are equally likely
+#define NUM_DETECTED_ENCODINGS 6
+static const encoding_type detected_encodings[NUM_DETECTED_ENCODINGS] = {
+  ENCODING_ASCII,
+  ENCODING_UTF8,
+  ENCODING_UTF32BE,
+  ENCODING_UTF32LE,
+  ENCODING_UTF16BE,
+  ENCODING_UTF16LE
+};
+
+// what detect_encodings has found out about a string so far
+struct detect_state {
+  // whether the bytes read are valid in each of the detected encodings
+  bool valid[NUM_DETECTED_ENCODINGS];
+
+  // the number of bytes read, and how many of them are zero at each offset from a multiple of 4
+  size_t size;
+  size_t zeros[4];
+};
+
+// read the bytes from start (a multiple of 4) to end, checking them in every encoding they have been valid in so far
+static void detect_window(const uint8_t *data, size_t size, size_t start, size_t end, detect_state &state) {
+  get_kernels().count_zeros(data+start, end-start, state.zeros);
+  state.size += end-start;
+  for (size_t i = 0; i < NUM_DETECTED_ENCODINGS; i++) {
+    // what is valid ASCII (the first encoding) is valid UTF-8
+    encoding_type encoding = detected_encodings[i];
+    if (!state.valid[i] || (encoding == ENCODING_UTF8 && state.valid[0]))
+      continue;
+
+    // leave out a code point that crosses the end of the window, and take all of one that crosses the start
+    size_t char_start = align_char(data, size, start, encoding);
+    size_t char_end = end < size ? align_char(data, size, end, encoding) : size;
+    size_t length;
+    state.valid[i] = char_start <= char_end && get_validator(encoding)(data+char_start, char_end-char_start, length);
+  }
+}
+
+// get the confidence that a string is in an encoding it is valid in, from its BOM or where its zero bytes are (text
+// rarely has a zero code point, so the zeros in UTF-16 and UTF-32 are the high bytes of small code points)
+static double get_confidence(const uint8_t *data, size_t size, const detect_state &state, encoding_type encoding) {
+  // a BOM settles it (unless it is the start of the BOM of UTF-32LE)
+  if (get_bom_size(data, size, encoding) != 0 && (encoding != ENCODING_UTF16LE || get_bom_size(data, size, ENCODING_UTF32LE) == 0))
+    return 1.0;
+
+  // ASCII and UTF-8 are likely unless there are zeros
+  const size_t *zeros = state.zeros;
+  if (encoding == ENCODING_ASCII || encoding == ENCODING_UTF8) {
+    if (state.size == 0)
+      return 1.0;
+    return 1.0-(double)(zeros[0]+zeros[1]+zeros[2]+zeros[3])/state.size;
+  }
+
+  // every UTF-32 code unit has a zero high byte, so being valid is likely already, and more so if the next byte is
+  // zero too (as it is for every code point below U+10000)
+  if (encoding == ENCODING_UTF32BE || encoding == ENCODING_UTF32LE) {
+    size_t units = state.size/4;
+    if (units == 0)
+      return 0.5;
+    return 0.5+0.5*zeros[encoding == ENCODING_UTF32BE ? 1 : 2]/units;
+  }
+
+  // most strings with an even size are valid UTF-16, so it takes the high bytes being zero more often than the low
+  // bytes (as they are for every code point below U+0100)
+  size_t units = state.size/2;
+  size_t high_zeros = encoding == ENCODING_UTF16BE ? zeros[0]+zeros[2] : zeros[1]+zeros[3];
+  size_t low_zeros = encoding == ENCODING_UTF16BE ? zeros[1]+zeros[3] : zeros[0]+zeros[2];
+  if (units == 0 || high_zeros <= low_zeros)
+    return 0.25;
+  return 0.25+0.75*(high_zeros-low_zeros)/units;
+}
+
+// order candidates from the most likely to the least
+static bool is_more_likely(const encoding_candidate &a, const encoding_candidate &b) {
+  return a.confidence > b.confidence;
+}
+
+// pick the encoding of a string from its candidates, which is the most likely one if it is likely enough, or else the
+// most likely of ASCII and UTF-8 if the string is valid in either
+static encoding_type pick_encoding(const vector<encoding_candidate> &candidates) {
+  if (!candidates.empty() && candidates[0].confidence >= 0.5)
+    return candidates[0].encoding;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (candidates[i].encoding == ENCODING_ASCII || candidates[i].encoding == ENCODING_UTF8)
+      return candidates[i].encoding;
+  }
+  return ENCODING_UNKNOWN;
+}
+
+// get the encoding whose BOM starts a string, if any (UTF-32LE comes before UTF-16LE, whose BOM starts the same way)
+static encoding_type get_bom_encoding(const uint8_t *data, size_t size) {
+  static const encoding_type encodings[] = {ENCODING_UTF32BE, ENCODING_UTF32LE, ENCODING_UTF16BE, ENCODING_UTF16LE, ENCODING_UTF8};
+  for (size_t i = 0; i < sizeof(encodings)/sizeof(encodings[0]); i++) {
+    if (get_bom_size(data, size, encodings[i]) != 0)
+      return encodings[i];
+  }
+  return ENCODING_UNKNOWN;
+}
+
 encoding_type utf::detect_encoding(const string &input) {
-  // look for 4-byte BOM
-  if (input.size() >= 4) {
-    // UTF32BE
-    if ((uint8_t)input[0] == 0x00 &&
-        (uint8_t)input[1] == 0x00 &&
-        (uint8_t)input[2] == 0xFE &&
-        (uint8_t)input[3] == 0xFF) {
-      if (is_valid(input, ENCODING_UTF32BE))
-        return ENCODING_UTF32BE;
+  return detect_encoding(input.data(), input.size());
+}
+
+encoding_type utf::detect_encoding(const char *input, size_t input_size) {
+  return pick_encoding(detect_encodings(input, input_size));
+}
+
+vector<encoding_candidate> utf::detect_encodings(const string &input, size_t sample_size) {
+  return detect_encodings(input.data(), input.size(), sample_size);
+}
+
+vector<encoding_candidate> utf::detect_encodings(const char *input, size_t input_size, size_t sample_size) {
+  const uint8_t *data = (const uint8_t *)input;
+  detect_state state;
+  for (size_t i = 0; i < NUM_DETECTED_ENCODINGS; i++)
+    state.valid[i] = true;
+  state.size = 0;
+  for (size_t i = 0; i < 4; i++)
+    state.zeros[i] = 0;
+
+  // read the whole string a chunk at a time, so each chunk is checked in every encoding while it is in the cache
+  if (sample_size == 0 || sample_size >= input_size) {
+    for (size_t pos = 0; pos < input_size; pos += TRANSCODE_CHUNK_SIZE)
+      detect_window(data, input_size, pos, input_size-pos < TRANSCODE_CHUNK_SIZE ? input_size : pos+TRANSCODE_CHUNK_SIZE, state);
+  } else {
+    // or read half the sample from the start
+    size_t prefix_size = sample_size/2-sample_size/2%4;
+    for (size_t pos = 0; pos < prefix_size; pos += TRANSCODE_CHUNK_SIZE)
+      detect_window(data, input_size, pos, prefix_size-pos < TRANSCODE_CHUNK_SIZE ? prefix_size : pos+TRANSCODE_CHUNK_SIZE, state);
+
+    // and the other half in windows spread evenly over the rest, the last of them at the end
+    size_t window_count = (sample_size-prefix_size)/DETECT_WINDOW_SIZE;
+    if (window_count == 0)
+      window_count = 1;
+    size_t stride = (input_size-prefix_size)/window_count;
+    for (size_t i = 1; i <= window_count; i++) {
+      size_t end = i == window_count ? input_size : prefix_size+stride*i;
+      size_t start = end-prefix_size > DETECT_WINDOW_SIZE ? end-DETECT_WINDOW_SIZE : prefix_size;
+      start -= start%4;
+      detect_window(data, input_size, start, end, state);
+    }
+  }
+
+  // rank the encodings the string is valid in
+  vector<encoding_candidate> candidates;
+  for (size_t i = 0; i < NUM_DETECTED_ENCODINGS; i++) {
+    if (!state.valid[i])
+      continue;
+    encoding_candidate candidate;
+    candidate.encoding = detected_encodings[i];
+    candidate.confidence = get_confidence(data, input_size, state, detected_encodings[i]);
+    candidates.push_back(candidate);
+  }
+  stable_sort(candidates.begin(), candidates.end(), is_more_likely);
+  return candidates;
+}
+
+utf::normalized_utf8::normalized_utf8() {
+  text = "";
+  text_size = 0;
+  copied = false;
+  encoding = ENCODING_UNKNOWN;
+}
+
+const char *utf::normalized_utf8::data() const {
+  return copied ? converted.data() : text;
+}
+
+size_t utf::normalized_utf8::size() const {
+  return copied ? converted.size() : text_size;
+}
+
+string utf::normalized_utf8::str() const {
+  return string(data(), size());
+}
+
+encoding_type utf::normalized_utf8::get_encoding() const {
+  return encoding;
+}
+
+bool utf::normalized_utf8::is_copy() const {
+  return copied;
+}
+
+normalized_utf8 utf::normalize_to_utf8(const string &input) {
+  return normalize_to_utf8(input.data(), input.size());
+}
+
+normalized_utf8 utf::normalize_to_utf8(const char *input, size_t input_size) {
+  normalized_utf8 result;
+  status normalized = try_normalize_to_utf8(input, input_size, result);
+  if (normalized.error != ERROR_NONE)
+    UTF_THROW(get_error_message(normalized.error, ENCODING_UTF8));
+  return result;
+}
+
+bool utf::is_valid(const string &input, encoding_type encoding) {
+  size_t length;
+  return is_valid(input.data(), input.size(), encoding, length);
+}
+
+bool utf::is_valid(const string &input, encoding_type encoding, size_t &length) {
+  return is_valid(input.data(), input.size(), encoding, length);
+}
+
+bool utf::is_valid(const char *input, size_t input_size, encoding_type encoding) {
+  size_t length;
+  return is_valid(input, input_size, encoding, length);
+}
+
+bool utf::is_valid(const char *input, size_t input_size, encoding_type encoding, size_t &length) {
+  // validate and count the code points in one pass
+  validator validate = get_validator(encoding);
+  if (validate)
+    return validate((const uint8_t *)input, input_size, length);
+
+  // the empty string is valid in any encoding
+  length = 0;
+  if (input_size == 0)
+    return true;
+  UTF_THROW("unknown input encoding");
+}
+
+string utf::convert_encoding(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  string result;
+  convert_encoding(input.data(), input.size(), input_encoding, output_encoding, include_bom, result);
+  return result;
+}
+
+void utf::convert_encoding(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output) {
+  convert_encoding(input.data(), input.size(), input_encoding, output_encoding, include_bom, output);
+}
+
+string utf::convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  string result;
+  convert_encoding(input, input_size, input_encoding, output_encoding, include_bom, result);
+  return result;
+}
+
+void utf::convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output) {
+  status result = try_convert_encoding(input, input_size, input_encoding, output_encoding, include_bom, output);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
+}
+
+size_t utf::convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, char *output, size_t output_capacity) {
+  size_t output_size;
+  status result = try_convert_encoding(input, input_size, input_encoding, output_encoding, include_bom, output, output_capacity, output_size);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
+  return output_size;
+}
+
+size_t utf::get_converted_size(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  return get_converted_size(input.data(), input.size(), input_encoding, output_encoding, include_bom);
+}
+
+size_t utf::get_converted_size(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  size_t output_size;
+  status result = try_get_converted_size(input, input_size, input_encoding, output_encoding, include_bom, output_size);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
+  return output_size;
+}
+
+size_t utf::get_length(const std::string &input, encoding_type encoding) {
+  return get_length(input.data(), input.size(), encoding);
+}
+
+size_t utf::get_length(const char *input, size_t input_size, encoding_type encoding) {
+  // count the code points while validating the string
+  size_t length;
+  if (!is_valid(input, input_size, encoding, length))
+    UTF_THROW("invalid code point");
+  return length;
+}
+
+size_t utf::get_char_size(const string &input, size_t pos, encoding_type encoding) {
+  return get_char_size(input.data(), input.size(), pos, encoding);
+}
+
+size_t utf::get_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding) {
+  size_t size;
+  status result = try_get_char_size(input, input_size, pos, encoding, size);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
+  return size;
+}
+
+uint32_t utf::get_char(const string &input, size_t pos, encoding_type encoding) {
+  return get_char(input.data(), input.size(), pos, encoding);
+}
+
+uint32_t utf::get_char(const char *input, size_t input_size, size_t pos, encoding_type encoding) {
+  uint32_t code_point;
+  status result = try_get_char(input, input_size, pos, encoding, code_point);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
+  return code_point;
+}
+
+size_t utf::get_prev_char_size(const string &input, size_t pos, encoding_type encoding) {
+  return get_prev_char_size(input.data(), input.size(), pos, encoding);
+}
+
+size_t utf::get_prev_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding) {
+  size_t size;
+  status result = try_get_prev_char_size(input, input_size, pos, encoding, size);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
+  return size;
+}
+
+uint32_t utf::get_prev_char(const string &input, size_t pos, encoding_type encoding) {
+  return get_prev_char(input.data(), input.size(), pos, encoding);
+}
+
+uint32_t utf::get_prev_char(const char *input, size_t input_size, size_t pos, encoding_type encoding) {
+  uint32_t code_point;
+  status result = try_get_prev_char(input, input_size, pos, encoding, code_point);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
+  return code_point;
+}
+
+size_t utf::align_to_boundary(const string &input, size_t pos, encoding_type encoding) {
+  return align_to_boundary(input.data(), input.size(), pos, encoding);
+}
+
+size_t utf::align_to_boundary(const char *input, size_t input_size, size_t pos, encoding_type encoding) {
+  size_t boundary;
+  status result = try_align_to_boundary(input, input_size, pos, encoding, boundary);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
+  return boundary;
+}
+
+code_point_view utf::code_points(const string &input, encoding_type encoding) {
+  return code_points(input.data(), input.size(), encoding);
+}
+
+code_point_view utf::code_points(const char *input, size_t input_size, encoding_type encoding) {
+  // pick the decoder once for the whole range
+  if (encoding == ENCODING_ASCII)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_ASCII>());
+  if (encoding == ENCODING_UTF8)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_UTF8>());
+  if (encoding == ENCODING_UTF16BE)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_UTF16BE>());
+  if (encoding == ENCODING_UTF16LE)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_UTF16LE>());
+  if (encoding == ENCODING_UTF32BE)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_UTF32BE>());
+  if (encoding == ENCODING_UTF32LE)
+    return code_point_view(input, input_size, make_char_decoder<ENCODING_UTF32LE>());
+
+  // the empty string has no code points in any encoding
+  if (input_size == 0)
+    return code_point_view();
+  UTF_THROW("unknown input encoding");
+}
+
+// validate a string and count its code points, and find whether they are all ASCII, one chunk at a time
+static bool validate_text(const uint8_t *data, size_t size, encoding_type encoding, size_t &length, bool &ascii) {
+  const validator validate = get_validator(encoding);
+  const measurer measure = get_measurer(encoding);
+  length = 0;
+  ascii = true;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t end = get_chunk_end(data, pos, size, encoding, TRANSCODE_CHUNK_SIZE);
+    size_t chunk_length;
+    if (!validate(data+pos, end-pos, chunk_length))
+      return false;
+
+    // the code points are all ASCII if each takes one byte in UTF-8
+    if (ascii && encoding != ENCODING_ASCII) {
+      size_t utf8_size, utf16_size;
+      measure(data+pos, end-pos, utf8_size, utf16_size);
+      ascii = utf8_size == chunk_length;
+    }
+    length += chunk_length;
+    pos = end;
+  }
+  return true;
+}
+
+template <encoding_type Encoding>
+utf::text_view<Encoding>::text_view(const char *input, size_t input_size) {
+  if (!validate_text((const uint8_t *)input, input_size, Encoding, text_length, ascii))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, Encoding));
+  text_data = input;
+  text_size = input_size;
+}
+
+template <encoding_type Encoding>
+utf::text_view<Encoding>::text_view(const string &input) {
+  if (!validate_text((const uint8_t *)input.data(), input.size(), Encoding, text_length, ascii))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, Encoding));
+  text_data = input.data();
+  text_size = input.size();
+}
+
+template <encoding_type Encoding>
+status utf::text_view<Encoding>::try_assign(const char *input, size_t input_size) UTF_NOEXCEPT {
+  size_t length;
+  bool is_ascii;
+  if (!validate_text((const uint8_t *)input, input_size, Encoding, length, is_ascii))
+    return make_status(ERROR_MALFORMED_INPUT, find_malformed((const uint8_t *)input, input_size, Encoding));
+  *this = text_view(input, input_size, length, is_ascii);
+  return make_status(ERROR_NONE, input_size);
+}
+
+template <encoding_type Encoding>
+utf::text<Encoding>::text(const char *input, size_t input_size) {
+  if (!validate_text((const uint8_t *)input, input_size, Encoding, text_length, ascii))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, Encoding));
+  contents.assign(input, input_size);
+}
+
+template <encoding_type Encoding>
+utf::text<Encoding>::text(const string &input) {
+  if (!validate_text((const uint8_t *)input.data(), input.size(), Encoding, text_length, ascii))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, Encoding));
+  contents = input;
+}
+
+template <encoding_type Encoding>
+status utf::text<Encoding>::try_assign(const char *input, size_t input_size) UTF_NOEXCEPT {
+  size_t length;
+  bool is_ascii;
+  if (!validate_text((const uint8_t *)input, input_size, Encoding, length, is_ascii))
+    return make_status(ERROR_MALFORMED_INPUT, find_malformed((const uint8_t *)input, input_size, Encoding));
+  contents.assign(input, input_size);
+  text_length = length;
+  ascii = is_ascii;
+  return make_status(ERROR_NONE, input_size);
+}
+
+// the texts in every encoding
+template class utf::text_view<ENCODING_ASCII>;
+template class utf::text_view<ENCODING_UTF8>;
+template class utf::text_view<ENCODING_UTF16BE>;
+template class utf::text_view<ENCODING_UTF16LE>;
+template class utf::text_view<ENCODING_UTF32BE>;
+template class utf::text_view<ENCODING_UTF32LE>;
+template class utf::text<ENCODING_ASCII>;
+template class utf::text<ENCODING_UTF8>;
+template class utf::text<ENCODING_UTF16BE>;
+template class utf::text<ENCODING_UTF16LE>;
+template class utf::text<ENCODING_UTF32BE>;
+template class utf::text<ENCODING_UTF32LE>;
+
+// the size of the blocks that a code point index validates and counts at a time, which bounds how far it walks to find
+// each offset it keeps
+#define INDEX_BLOCK_SIZE 128
+
+// skip over a number of code points in a valid string (which must have a code point after them)
+static size_t skip_chars(const uint8_t *data, size_t pos, size_t count, encoding_type encoding) {
+  if (encoding == ENCODING_UTF8) {
+    // count the bytes that aren't continuation bytes 8 at a time (while at least 8 code points are left, the next 8
+    // bytes are all in the string)
+    while (count >= 8) {
+      uint64_t word;
+      memcpy(&word, data+pos, 8);
+      uint64_t starts = ((~word>>7)|(word>>6))&0x0101010101010101ULL;
+      count -= (starts*0x0101010101010101ULL)>>56;
+      pos += 8;
     }
 
-    // UTF32LE
-    if ((uint8_t)input[0] == 0xFF &&
-        (uint8_t)input[1] == 0xFE &&
-        (uint8_t)input[2] == 0x00 &&
-        (uint8_t)input[3] == 0x00) {
-      if (is_valid(input, ENCODING_UTF32LE))
-        return ENCODING_UTF32LE;
+    // then one byte at a time, stopping at the start of the next code point
+    for (;; pos++) {
+      if ((data[pos]&0xC0) == 0x80)
+        continue;
+      if (count == 0)
+        return pos;
+      count--;
     }
   }
-
-  // look for 2-byte BOM
-  if (input.size() >= 2) {
-    // UTF16BE
-    if ((uint8_t)input[0] == 0xFE &&
-        (uint8_t)input[1] == 0xFF) {
-      if (is_valid(input, ENCODING_UTF16BE))
-        return ENCODING_UTF16BE;
+  if (encoding == ENCODING_UTF16BE || encoding == ENCODING_UTF16LE) {
+    // the high byte of each unit comes first in UTF-16BE and second in UTF-16LE, and loading the pattern puts the mask
+    // in the byte order of the host
+    static const uint8_t high_bytes[9] = {1, 0, 1, 0, 1, 0, 1, 0, 1};
+    size_t high = encoding == ENCODING_UTF16BE ? 0 : 1;
+    uint64_t mask;
+    memcpy(&mask, high_bytes+high, 8);
+
+    // count the units that aren't low surrogates 4 at a time (while at least 4 code points are left, the next 8 bytes
+    // are all in the string)
+    while (count >= 4) {
+      uint64_t word;
+      memcpy(&word, data+pos, 8);
+      word = (word&0xFCFCFCFCFCFCFCFCULL)^0xDCDCDCDCDCDCDCDCULL;
+      uint64_t starts = ((((word&0x7F7F7F7F7F7F7F7FULL)+0x7F7F7F7F7F7F7F7FULL)|word)>>7)&mask;
+      count -= (starts*0x0101010101010101ULL)>>56;
+      pos += 8;
     }
 
-    // UTF16LE
-    if ((uint8_t)input[0] == 0xFF &&
-        (uint8_t)input[1] == 0xFE) {
-      if (is_valid(input, ENCODING_UTF16LE))
-        return ENCODING_UTF16LE;
+    // then one unit at a time, stopping at the start of the next code point
+    for (;; pos += 2) {
+      if ((data[pos+high]&0xFC) == 0xDC)
+        continue;
+      if (count == 0)
+        return pos;
+      count--;
     }
   }
-
-  // ASCII
-  if (is_valid(input, ENCODING_ASCII))
-    return ENCODING_ASCII;
-
-  // UTF8
-  if (is_valid(input, ENCODING_UTF8))
-    return ENCODING_UTF8;
-
-  // unknown encoding
-  return ENCODING_UNKNOWN;
+  if (encoding == ENCODING_UTF32BE || encoding == ENCODING_UTF32LE)
+    return pos+count*4;
+  return pos+count;
 }
 
-bool utf::is_valid(const string &input, encoding_type encoding) {
-  // start at the beginning
+// validate a string and count its code points, and find the offset of every code point at a multiple of the interval
+// (which only the encodings with code points of different sizes need)
+static bool index_code_points(const uint8_t *data, size_t size, encoding_type encoding, size_t &length, vector<size_t> &offsets) {
+  const validator validate = get_validator(encoding);
+  length = 0;
+  offsets.clear();
+  if (encoding == ENCODING_ASCII || encoding == ENCODING_UTF32BE || encoding == ENCODING_UTF32LE)
+    return validate(data, size, length);
+
+  // count the code points in small blocks, so the offsets in each block are found by walking only that block
   size_t pos = 0;
-  while (pos < input.size()) {
-    // check if the character is valid
-    size_t size = get_char_size(input, pos, encoding);
-    if (size == 0)
+  while (pos < size) {
+    size_t end = get_chunk_end(data, pos, size, encoding, INDEX_BLOCK_SIZE);
+    size_t block_length;
+    if (!validate(data+pos, end-pos, block_length))
       return false;
-    
-    // move to the next character
-    pos += size;
+    while (offsets.size()*code_point_index::interval < length+block_length)
+      offsets.push_back(skip_chars(data, pos, offsets.size()*code_point_index::interval-length, encoding));
+    length += block_length;
+    pos = end;
   }
-
-  // if we didn't fail yet, return success
   return true;
 }
 
-string utf::convert_encoding(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
-  // basic error checking
-  if (input_encoding != ENCODING_ASCII && input_encoding != ENCODING_UTF8 &&
-      input_encoding != ENCODING_UTF16BE && input_encoding != ENCODING_UTF16LE &&
-      input_encoding != ENCODING_UTF32BE && input_encoding != ENCODING_UTF32LE)
-    throw encode_error("unknown input encoding");
-  if (output_encoding != ENCODING_ASCII && output_encoding != ENCODING_UTF8 &&
-      output_encoding != ENCODING_UTF16BE && output_encoding != ENCODING_UTF16LE &&
-      output_encoding != ENCODING_UTF32BE && output_encoding != ENCODING_UTF32LE)
-    throw encode_error("unknown output encoding");
-  if (!is_valid(input, input_encoding))
-    throw encode_error("malformed input string");
-
-  // store the result
-  string result;
+utf::code_point_index::code_point_index(const char *input, size_t input_size, encoding_type input_encoding) {
+  if (get_validator(input_encoding) == NULL)
+    UTF_THROW(get_error_message(ERROR_UNKNOWN_INPUT_ENCODING, input_encoding));
+  if (!index_code_points((const uint8_t *)input, input_size, input_encoding, text_length, offsets))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, input_encoding));
+  text_data = input;
+  text_size = input_size;
+  encoding = input_encoding;
+}
 
-  // add the BOM if necessary
-  if (include_bom) {
-    // UTF8
-    if (output_encoding == ENCODING_UTF8) {
-      result.push_back(0xEF);
-      result.push_back(0xBB);
-      result.push_back(0xBF);
-    }
+utf::code_point_index::code_point_index(const string &input, encoding_type input_encoding) {
+  if (get_validator(input_encoding) == NULL)
+    UTF_THROW(get_error_message(ERROR_UNKNOWN_INPUT_ENCODING, input_encoding));
+  if (!index_code_points((const uint8_t *)input.data(), input.size(), input_encoding, text_length, offsets))
+    UTF_THROW(get_error_message(ERROR_MALFORMED_INPUT, input_encoding));
+  text_data = input.data();
+  text_size = input.size();
+  encoding = input_encoding;
+}
 
-    // UTF16BE
-    if (output_encoding == ENCODING_UTF16BE) {
-      result.push_back(0xFE);
-      result.push_back(0xFF);
-    }
+status utf::code_point_index::try_assign(const char *input, size_t input_size, encoding_type input_encoding) UTF_NOEXCEPT {
+  if (get_validator(input_encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, 0);
+
+  // build the index on the side, so this one is left as it was if there is an error
+  size_t length;
+  vector<size_t> new_offsets;
+  if (!index_code_points((const uint8_t *)input, input_size, input_encoding, length, new_offsets))
+    return make_status(ERROR_MALFORMED_INPUT, find_malformed((const uint8_t *)input, input_size, input_encoding));
+  text_data = input;
+  text_size = input_size;
+  encoding = input_encoding;
+  text_length = length;
+  offsets.swap(new_offsets);
+  return make_status(ERROR_NONE, input_size);
+}
 
-    // UTF16LE
-    if (output_encoding == ENCODING_UTF16LE) {
-      result.push_back(0xFF);
-      result.push_back(0xFE);
-    }
+size_t utf::code_point_index::get_offset(size_t index) const {
+  if (index > text_length)
+    UTF_THROW(get_error_message(ERROR_INDEX_OUT_OF_RANGE, encoding));
+  if (index == text_length)
+    return text_size;
 
-    // UTF32BE
-    if (output_encoding == ENCODING_UTF32BE) {
-      result.push_back(0x00);
-      result.push_back(0x00);
-      result.push_back(0xFE);
-      result.push_back(0xFF);
-    }
+  // start from the nearest offset that is kept
+  if (offsets.empty())
+    return skip_chars((const uint8_t *)text_data, 0, index, encoding);
+  return skip_chars((const uint8_t *)text_data, offsets[index/interval], index%interval, encoding);
+}
 
-    // UTF32LE
-    if (output_encoding == ENCODING_UTF32LE) {
-      result.push_back(0xFF);
-      result.push_back(0xFE);
-      result.push_back(0x00);
-      result.push_back(0x00);
-    }
-  }
+uint32_t utf::code_point_index::get_char(size_t index) const {
+  if (index >= text_length)
+    UTF_THROW(get_error_message(ERROR_INDEX_OUT_OF_RANGE, encoding));
+  size_t pos = get_offset(index);
+  uint32_t code_point = 0;
+  decode_char((const uint8_t *)text_data+pos, text_size-pos, encoding, code_point);
+  return code_point;
+}
 
-  // start at the beginning
-  size_t pos = 0;
+string utf::code_point_index::substr(size_t index, size_t count) const {
+  size_t start = get_offset(index);
+  if (count >= text_length-index)
+    return string(text_data+start, text_size-start);
 
-  // skip the BOM in the input if present
-  if (input_encoding == ENCODING_UTF8) {
-    if (input.size() >= 3) {
-      if ((uint8_t)input[0] == 0xEF &&
-          (uint8_t)input[1] == 0xBB &&
-          (uint8_t)input[2] == 0xBF)
-        pos += 3;
-    }
-  }
-  if (input_encoding == ENCODING_UTF16BE) {
-    if (input.size() >= 2) {
-      if ((uint8_t)input[0] == 0xFE &&
-          (uint8_t)input[1] == 0xFF)
-        pos += 2;
-    }
-  }
-  if (input_encoding == ENCODING_UTF16LE) {
-    if (input.size() >= 2) {
-      if ((uint8_t)input[0] == 0xFF &&
-          (uint8_t)input[1] == 0xFE)
-        pos += 2;
-    }
-  }
-  if (input_encoding == ENCODING_UTF32BE) {
-    if (input.size() >= 4) {
-      if ((uint8_t)input[0] == 0x00 &&
-          (uint8_t)input[1] == 0x00 &&
-          (uint8_t)input[2] == 0xFE &&
-          (uint8_t)input[3] == 0xFF)
-        pos += 4;
-    }
-  }
-  if (input_encoding == ENCODING_UTF32LE) {
-    if (input.size() >= 4) {
-      if ((uint8_t)input[0] == 0xFF &&
-          (uint8_t)input[1] == 0xFE &&
-          (uint8_t)input[2] == 0x00 &&
-          (uint8_t)input[3] == 0x00)
-        pos += 4;
-    }
+  // the end is usually close to the start, so walk to it unless an offset that is kept is closer
+  size_t end = index/interval == (index+count)/interval ? skip_chars((const uint8_t *)text_data, start, count, encoding) : get_offset(index+count);
+  return string(text_data+start, end-start);
+}
+
+void utf::convert_valid_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output) {
+  // basic error checking
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    UTF_THROW(get_error_message(error, output_encoding));
+
+  // add a BOM to the output if necessary (a BOM in the input is kept, since a text counts it as a code point)
+  const uint8_t *data = (const uint8_t *)input;
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // convert the string after what is already in the output, leaving the output as it was if there is an error
+  size_t start = output.size();
+  output.resize(start+bom_size+get_max_output_size(input_size, input_encoding, output_encoding));
+  uint8_t *result = (uint8_t *)&output[0]+start;
+  memcpy(result, bom, bom_size);
+  size_t output_size;
+  status converted = convert_valid_units(data, input_size, input_encoding, output_encoding, result+bom_size, output_size);
+  if (converted.error != ERROR_NONE) {
+    output.resize(start);
+    UTF_THROW(get_error_message(converted.error, output_encoding));
   }
+  output.resize(start+bom_size+output_size);
+}
 
-  // iterate through the input string
-  while (pos < input.size()) {
-    // add the code point to the output string
-    add_char(result, get_char(input, pos, input_encoding), output_encoding);
+void utf::set_char(string &input, size_t pos, uint32_t code_point, encoding_type encoding) {
+  // get the size of the code point to replace
+  size_t old_size = get_char_size(input, pos, encoding);
 
-    // advance to the next code point
-    pos += get_char_size(input, pos, input_encoding);
-  }
+  // make sure the code point is valid
+  if (old_size == 0)
+    UTF_THROW("index does not refer to a valid code point");
 
-  // return the result
-  return result;
+  // get the size of the new code point
+  string new_code_point;
+  add_char(new_code_point, code_point, encoding);
+  if (old_size == new_code_point.size()) {
+    for (size_t i = 0; i < old_size; i++)
+      input[pos+i] = new_code_point[i];
+  } else
+    input = input.substr(0, pos)+new_code_point+input.substr(pos+new_code_point.size(), input.size()-(pos+new_code_point.size()));
 }
 
-size_t utf::get_length(const std::string &input, encoding_type encoding) {
-  // do a linear walk through the string to count each code point
-  size_t size = 0;
-  size_t pos = 0;
-  while (pos < input.size()) {
-    size_t char_size = get_char_size(input, pos, encoding);
-    if (!char_size)
-      throw encode_error("invalid code point");
-    pos += char_size;
-    ++size;
-  }
-  return size;
+void utf::add_char(string &input, uint32_t code_point, encoding_type encoding) {
+  status result = try_add_char(input, code_point, encoding);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, encoding));
 }
 
-size_t utf::get_char_size(const string &input, size_t pos, encoding_type encoding) {
-  // check the range of pos
-  if (pos >= input.size())
-    throw encode_error("index out of range");
-
-  // ASCII
-  if (encoding == ENCODING_ASCII) {
-    // make sure the code point is within the valid range
-    if ((unsigned char)input[pos] <= 127)
-      return 1;
+string utf::convert_encoding_lossy(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  return convert_encoding_lossy(input.data(), input.size(), input_encoding, output_encoding, include_bom);
+}
+
+string utf::convert_encoding_lossy(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  string result;
+  size_t replacements;
+  status converted = try_convert_encoding_lossy(input, input_size, input_encoding, output_encoding, include_bom, result, replacements);
+  if (converted.error != ERROR_NONE)
+    UTF_THROW(get_error_message(converted.error, output_encoding));
+  return result;
+}
+
+size_t utf::repair(string &input, encoding_type encoding) {
+  // leave a valid string as it is
+  size_t length;
+  if (is_valid(input.data(), input.size(), encoding, length))
     return 0;
-  }
 
-  // UTF8
+  // and otherwise replace everything from the first malformed code point on
+  const uint8_t *data = (const uint8_t *)input.data();
+  size_t pos = find_malformed(data, input.size(), encoding);
+  string repaired(get_max_replaced_size(input.size()-pos, encoding, encoding), '\0');
+  size_t repaired_size;
+  size_t replacements = replace_units(data+pos, input.size()-pos, encoding, encoding, (uint8_t *)&repaired[0], repaired_size);
+  input.replace(pos, string::npos, repaired, 0, repaired_size);
+  return replacements;
+}
+
+status utf::validate(const string &input, encoding_type encoding, size_t &length) UTF_NOEXCEPT {
+  return validate(input.data(), input.size(), encoding, length);
+}
+
+status utf::validate(const char *input, size_t input_size, encoding_type encoding, size_t &length) UTF_NOEXCEPT {
+  // validate and count the code points in one pass, and only look for the error if there is one
+  length = 0;
+  const validator check = get_validator(encoding);
+  if (check == NULL)
+    return make_status(input_size == 0 ? ERROR_NONE : ERROR_UNKNOWN_INPUT_ENCODING, 0);
+  const uint8_t *data = (const uint8_t *)input;
+  if (check(data, input_size, length))
+    return make_status(ERROR_NONE, input_size);
+  return make_status(ERROR_MALFORMED_INPUT, find_malformed(data, input_size, encoding));
+}
+
+status utf::try_normalize_to_utf8(const string &input, normalized_utf8 &output) UTF_NOEXCEPT {
+  return try_normalize_to_utf8(input.data(), input.size(), output);
+}
+
+status utf::try_normalize_to_utf8(const char *input, size_t input_size, normalized_utf8 &output) UTF_NOEXCEPT {
+  const uint8_t *data = (const uint8_t *)input;
+  output = normalized_utf8();
+
+  // a BOM names the encoding, so the string can be validated and converted in the same pass
+  encoding_type encoding = get_bom_encoding(data, input_size);
+  bool done = false;
   if (encoding == ENCODING_UTF8) {
-    // one byte
-    if ((uint8_t)input[pos] < 0x80)
-      return 1;
-
-    // two bytes
-    if ((uint8_t)input[pos] >= 0xC0 && (uint8_t)input[pos] < 0xE0) {
-      if (pos+1 < input.size()) {
-        if ((uint8_t)input[pos+1] >= 0x80 && (uint8_t)input[pos+1] < 0xC0)
-          return 2;
-      }
+    size_t length;
+    done = get_validator(ENCODING_UTF8)(data+3, input_size-3, length);
+  } else if (encoding != ENCODING_UNKNOWN)
+    done = try_convert_encoding(input, input_size, encoding, ENCODING_UTF8, false, output.converted).error == ERROR_NONE;
+
+  // otherwise (or if the string is malformed in the encoding of its BOM) it takes a pass to detect the encoding, and
+  // another to convert it unless it is ASCII or UTF-8 already
+  if (!done) {
+    encoding = pick_encoding(detect_encodings(input, input_size));
+    if (encoding == ENCODING_UNKNOWN)
+      return make_status(ERROR_UNKNOWN_INPUT_ENCODING, 0);
+    if (encoding != ENCODING_ASCII && encoding != ENCODING_UTF8) {
+      status converted = try_convert_encoding(input, input_size, encoding, ENCODING_UTF8, false, output.converted);
+      if (converted.error != ERROR_NONE)
+        return converted;
     }
+  }
 
-    // three bytes
-    if ((uint8_t)input[pos] >= 0xE0 && (uint8_t)input[pos] < 0xF0) {
-      if (pos+2 < input.size()) {
-        if ((uint8_t)input[pos+1] >= 0x80 && (uint8_t)input[pos+1] < 0xC0 &&
-            (uint8_t)input[pos+2] >= 0x80 && (uint8_t)input[pos+2] < 0xC0)
-          return 3;
-      }
-    }
+  // point into the input if there was nothing to convert
+  output.encoding = encoding;
+  output.copied = encoding != ENCODING_ASCII && encoding != ENCODING_UTF8;
+  if (!output.copied) {
+    size_t bom_size = get_bom_size(data, input_size, encoding);
+    output.text = input+bom_size;
+    output.text_size = input_size-bom_size;
+  }
+  return make_status(ERROR_NONE, input_size);
+}
 
-    // four bytes
-    if ((uint8_t)input[pos] >= 0xF0 && (uint8_t)input[pos] < 0xF8) {
-      if (pos+3 < input.size()) {
-        if ((uint8_t)input[pos+1] >= 0x80 && (uint8_t)input[pos+1] < 0xC0 &&
-            (uint8_t)input[pos+2] >= 0x80 && (uint8_t)input[pos+2] < 0xC0 &&
-            (uint8_t)input[pos+3] >= 0x80 && (uint8_t)input[pos+3] < 0xC0) {
-          // calculate the code point
-          uint32_t code_point = ((((uint8_t)input[pos])&0x07)<<18)+((((uint8_t)input[pos+1])&0x3F)<<12)+((((uint8_t)input[pos+2])&0x3F)<<6)+(((uint8_t)input[pos+3])&0x3F);
+status utf::try_convert_encoding(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output) UTF_NOEXCEPT {
+  return try_convert_encoding(input.data(), input.size(), input_encoding, output_encoding, include_bom, output);
+}
 
-          // make sure the code point is within the valid range
-          if (code_point <= 0x10FFFF)
-            return 4;
-        }
-      }
-    }
+status utf::try_convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output) UTF_NOEXCEPT {
+  // basic error checking
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, 0);
 
-    // invalid
-    return 0;
+  // skip the BOM in the input if present
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = get_bom_size(data, input_size, input_encoding);
+
+  // add the BOM if necessary
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // make room for the longest possible output after what is already there
+  size_t start = output.size();
+  output.resize(start+bom_size+get_max_output_size(input_size-pos, input_encoding, output_encoding));
+  uint8_t *result = (uint8_t *)&output[0]+start;
+  memcpy(result, bom, bom_size);
+
+  // convert the string, leaving the output as it was if there is an error
+  size_t output_size;
+  status converted = convert_units(data+pos, input_size-pos, input_encoding, output_encoding, result+bom_size, output_size);
+  if (converted.error != ERROR_NONE) {
+    output.resize(start);
+    return make_status(converted.error, pos+converted.offset);
   }
+  output.resize(start+bom_size+output_size);
+  return make_status(ERROR_NONE, input_size);
+}
 
-  // UTF16BE
-  if (encoding == ENCODING_UTF16BE) {
-    // make sure there are 2 bytes
-    if (pos+1 >= input.size())
-      return 0;
+status utf::try_convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, char *output, size_t output_capacity, size_t &output_size) UTF_NOEXCEPT {
+  // basic error checking
+  output_size = 0;
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, 0);
 
-    // get the high surrogate
-    uint16_t high = (((uint8_t)input[pos])<<8)+((uint8_t)input[pos+1]);
+  // skip the BOM in the input if present
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = get_bom_size(data, input_size, input_encoding);
 
-    // two bytes
-    if (high < 0xD800 || high > 0xDFFF)
-      return 2;
+  // add the BOM if necessary
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // convert straight into the buffer if it has room for the longest possible output
+  uint8_t *result = (uint8_t *)output;
+  size_t converted_size;
+  if (output_capacity >= bom_size+get_max_output_size(input_size-pos, input_encoding, output_encoding)) {
+    status converted = convert_units(data+pos, input_size-pos, input_encoding, output_encoding, result+bom_size, converted_size);
+    if (converted.error != ERROR_NONE)
+      return make_status(converted.error, pos+converted.offset);
+    memcpy(result, bom, bom_size);
+    output_size = bom_size+converted_size;
+    return make_status(ERROR_NONE, input_size);
+  }
 
-    // make sure the high surrogate is within the valid range
-    if (high > 0xDBFF)
-      return 0;
+  // otherwise make sure the output fits
+  status measured = measure_units(data+pos, input_size-pos, input_encoding, output_encoding, converted_size);
+  if (measured.error != ERROR_NONE)
+    return make_status(measured.error, pos+measured.offset);
+  if (output_capacity < bom_size+converted_size)
+    return make_status(ERROR_OUTPUT_TOO_SMALL, 0);
+  memcpy(result, bom, bom_size);
+
+  // and convert it
+  output_size = bom_size+convert_measured_units(data+pos, input_size-pos, input_encoding, output_encoding, result+bom_size, output_capacity-bom_size);
+  return make_status(ERROR_NONE, input_size);
+}
 
-    // make sure there are 4 bytes
-    if (pos+3 >= input.size())
-      return 0;
+status utf::try_get_converted_size(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t &output_size) UTF_NOEXCEPT {
+  return try_get_converted_size(input.data(), input.size(), input_encoding, output_encoding, include_bom, output_size);
+}
 
-    // get the low surrogate
-    uint16_t low = (((uint8_t)input[pos+2])<<8)+((uint8_t)input[pos+3]);
+status utf::try_get_converted_size(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t &output_size) UTF_NOEXCEPT {
+  // basic error checking
+  output_size = 0;
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, 0);
+
+  // the BOM in the input is dropped, and the one in the output is added if necessary
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = get_bom_size(data, input_size, input_encoding);
+  size_t bom_size = 0;
+  get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // find the size of the rest
+  size_t measured_size;
+  status measured = measure_units(data+pos, input_size-pos, input_encoding, output_encoding, measured_size);
+  if (measured.error != ERROR_NONE)
+    return make_status(measured.error, pos+measured.offset);
+  output_size = bom_size+measured_size;
+  return make_status(ERROR_NONE, input_size);
+}
 
-    // make sure the low surrogate is within the valid range
-    if (low < 0xDC00 || low > 0xDFFF)
-      return 0;
+status utf::try_get_length(const string &input, encoding_type encoding, size_t &length) UTF_NOEXCEPT {
+  return validate(input.data(), input.size(), encoding, length);
+}
 
-    // calculate the code point
-    uint32_t code_point = 0x10000+((high-0xD800)<<10)+(low-0xDC00);
+status utf::try_get_length(const char *input, size_t input_size, encoding_type encoding, size_t &length) UTF_NOEXCEPT {
+  // count the code points while validating the string
+  return validate(input, input_size, encoding, length);
+}
 
-    // make sure the code point is within the valid range
-    if (code_point <= 0x10FFFF)
-      return 4;
+status utf::try_get_char_size(const string &input, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT {
+  return try_get_char_size(input.data(), input.size(), pos, encoding, size);
+}
 
-    // invalid
-    return 0;
-  }
+status utf::try_get_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT {
+  // check the range of pos and the encoding
+  size = 0;
+  if (pos >= input_size)
+    return make_status(ERROR_INDEX_OUT_OF_RANGE, pos);
+  if (get_validator(encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, pos);
+
+  // decode the code point to make sure it is valid (a size of 0 means it isn't, which is not an error)
+  uint32_t code_point;
+  size = decode_char((const uint8_t *)input+pos, input_size-pos, encoding, code_point);
+  return make_status(ERROR_NONE, pos);
+}
 
-  // UTF16LE
-  if (encoding == ENCODING_UTF16LE) {
-    // make sure there are 2 bytes
-    if (pos+1 >= input.size())
-      return 0;
+status utf::try_get_char(const string &input, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT {
+  return try_get_char(input.data(), input.size(), pos, encoding, code_point);
+}
 
-    // get the high surrogate
-    uint16_t high = (((uint8_t)input[pos+1])<<8)+((uint8_t)input[pos]);
+status utf::try_get_char(const char *input, size_t input_size, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT {
+  // check the range of pos and the encoding
+  code_point = 0;
+  if (pos >= input_size)
+    return make_status(ERROR_INDEX_OUT_OF_RANGE, pos);
+  if (get_validator(encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, pos);
 
-    // two bytes
-    if (high < 0xD800 || high > 0xDFFF)
-      return 2;
+  // make sure there is a character at pos
+  if (decode_char((const uint8_t *)input+pos, input_size-pos, encoding, code_point) == 0)
+    return make_status(ERROR_INVALID_INDEX, pos);
+  return make_status(ERROR_NONE, pos);
+}
 
-    // make sure the high surrogate is within the valid range
-    if (high > 0xDBFF)
-      return 0;
+status utf::try_get_prev_char_size(const string &input, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT {
+  return try_get_prev_char_size(input.data(), input.size(), pos, encoding, size);
+}
 
-    // make sure there are 4 bytes
-    if (pos+3 >= input.size())
-      return 0;
+status utf::try_get_prev_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT {
+  // check the range of pos (there must be something before it) and the encoding
+  size = 0;
+  if (pos == 0 || pos > input_size)
+    return make_status(ERROR_INDEX_OUT_OF_RANGE, pos);
+  if (get_validator(encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, pos);
+
+  // decode the code point to make sure it is valid (a size of 0 means it isn't, which is not an error)
+  uint32_t code_point;
+  size = decode_prev_char((const uint8_t *)input, pos, encoding, code_point);
+  return make_status(ERROR_NONE, pos-size);
+}
 
-    // get the low surrogate
-    uint16_t low = (((uint8_t)input[pos+3])<<8)+((uint8_t)input[pos+2]);
+status utf::try_get_prev_char(const string &input, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT {
+  return try_get_prev_char(input.data(), input.size(), pos, encoding, code_point);
+}
 
-    // make sure the low surrogate is within the valid range
-    if (low < 0xDC00 || low > 0xDFFF)
-      return 0;
+status utf::try_get_prev_char(const char *input, size_t input_size, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT {
+  // check the range of pos (there must be something before it) and the encoding
+  code_point = 0;
+  if (pos == 0 || pos > input_size)
+    return make_status(ERROR_INDEX_OUT_OF_RANGE, pos);
+  if (get_validator(encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, pos);
 
-    // calculate the code point
-    uint32_t code_point = 0x10000+((high-0xD800)<<10)+(low-0xDC00);
+  // make sure a character ends at pos
+  size_t size = decode_prev_char((const uint8_t *)input, pos, encoding, code_point);
+  if (size == 0)
+    return make_status(ERROR_INVALID_INDEX, pos);
+  return make_status(ERROR_NONE, pos-size);
+}
 
-    // make sure the code point is within the valid range
-    if (code_point <= 0x10FFFF)
-      return 4;
+status utf::try_align_to_boundary(const string &input, size_t pos, encoding_type encoding, size_t &boundary) UTF_NOEXCEPT {
+  return try_align_to_boundary(input.data(), input.size(), pos, encoding, boundary);
+}
 
-    // invalid
-    return 0;
-  }
+status utf::try_align_to_boundary(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &boundary) UTF_NOEXCEPT {
+  // check the range of pos (the end of the string is a boundary) and the encoding
+  boundary = 0;
+  if (pos > input_size)
+    return make_status(ERROR_INDEX_OUT_OF_RANGE, pos);
+  if (get_validator(encoding) == NULL && input_size > 0)
+    return make_status(ERROR_UNKNOWN_INPUT_ENCODING, pos);
+
+  // look back no further than the start of one code point
+  boundary = align_char((const uint8_t *)input, input_size, pos, encoding);
+  return make_status(ERROR_NONE, boundary);
+}
 
-  // UTF32BE
-  if (encoding == ENCODING_UTF32BE) {
-    // make sure there are 4 bytes
-    if (pos+3 >= input.size())
-      return 0;
+status utf::try_add_char(string &input, uint32_t code_point, encoding_type encoding) UTF_NOEXCEPT {
+  // make sure the code point is within the valid range and the encoding is known
+  if (code_point > 0x10FFFF)
+    return make_status(ERROR_INVALID_CODE_POINT, input.size());
+  if (get_validator(encoding) == NULL)
+    return make_status(ERROR_UNKNOWN_OUTPUT_ENCODING, input.size());
 
-    // calculate the code point
-    uint32_t code_point = (((uint8_t)input[pos])<<24)+(((uint8_t)input[pos+1])<<16)+(((uint8_t)input[pos+2])<<8)+((uint8_t)input[pos+3]);
+  // encode the code point
+  uint8_t buffer[4];
+  size_t size = encode_char(code_point, encoding, buffer);
+  if (size == 0)
+    return make_status(ERROR_UNENCODABLE_CODE_POINT, input.size());
+  input.append((const char *)buffer, size);
+  return make_status(ERROR_NONE, input.size()-size);
+}
 
-    // make sure the code point is within the valid range
-    if (code_point <= 0x10FFFF)
-      return 4;
+status utf::try_convert_encoding_lossy(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, size_t &replacements) UTF_NOEXCEPT {
+  return try_convert_encoding_lossy(input.data(), input.size(), input_encoding, output_encoding, include_bom, output, replacements);
+}
 
-    // invalid
-    return 0;
-  }
+status utf::try_convert_encoding_lossy(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, size_t &replacements) UTF_NOEXCEPT {
+  // basic error checking (the encodings are the only thing that can go wrong)
+  replacements = 0;
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, 0);
 
-  // UTF32LE
-  if (encoding == ENCODING_UTF32LE) {
-    // make sure there are 4 bytes
-    if (pos+3 >= input.size())
-      return 0;
+  // skip the BOM in the input if present
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = get_bom_size(data, input_size, input_encoding);
 
-    // calculate the code point
-    uint32_t code_point = (((uint8_t)input[pos+3])<<24)+(((uint8_t)input[pos+2])<<16)+(((uint8_t)input[pos+1])<<8)+((uint8_t)input[pos]);
+  // add the BOM if necessary
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+
+  // and convert the rest, making room for the longest possible output
+  size_t start = output.size();
+  output.resize(start+bom_size+get_max_replaced_size(input_size-pos, input_encoding, output_encoding));
+  uint8_t *result = (uint8_t *)&output[0]+start;
+  memcpy(result, bom, bom_size);
+  size_t output_size;
+  replacements = replace_units(data+pos, input_size-pos, input_encoding, output_encoding, result+bom_size, output_size);
+  output.resize(start+bom_size+output_size);
+  return make_status(ERROR_NONE, input_size);
+}
 
-    // make sure the code point is within the valid range
-    if (code_point <= 0x10FFFF)
-      return 4;
+string utf::convert_encoding_parallel(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, unsigned int thread_count) {
+  return convert_encoding_parallel(input.data(), input.size(), input_encoding, output_encoding, include_bom, thread_count);
+}
 
-    // invalid
-    return 0;
+string utf::convert_encoding_parallel(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, unsigned int thread_count) {
+  string result;
+  status converted = try_convert_encoding_parallel(input, input_size, input_encoding, output_encoding, include_bom, result, thread_count);
+  if (converted.error != ERROR_NONE)
+    UTF_THROW(get_error_message(converted.error, output_encoding));
+  return result;
+}
+
+bool utf::is_valid_parallel(const string &input, encoding_type encoding, unsigned int thread_count) {
+  return is_valid_parallel(input.data(), input.size(), encoding, thread_count);
+}
+
+bool utf::is_valid_parallel(const char *input, size_t input_size, encoding_type encoding, unsigned int thread_count) {
+  size_t length;
+  status result = validate_parallel(input, input_size, encoding, length, thread_count);
+  if (result.error == ERROR_UNKNOWN_INPUT_ENCODING)
+    UTF_THROW("unknown input encoding");
+  return result.error == ERROR_NONE;
+}
+
+status utf::validate_parallel(const string &input, encoding_type encoding, size_t &length, unsigned int thread_count) UTF_NOEXCEPT {
+  return validate_parallel(input.data(), input.size(), encoding, length, thread_count);
+}
+
+status utf::validate_parallel(const char *input, size_t input_size, encoding_type encoding, size_t &length, unsigned int thread_count) UTF_NOEXCEPT {
+  // small strings aren't worth splitting
+  size_t count = get_thread_count(input_size, thread_count);
+  if (count == 1 || get_validator(encoding) == NULL)
+    return validate(input, input_size, encoding, length);
+
+  // validate and count the pieces at once, and find the error from the first piece that has one
+  const uint8_t *data = (const uint8_t *)input;
+  vector<parallel_task> tasks = split_tasks(data, input_size, encoding, encoding, count);
+  run_tasks(validate_task, tasks);
+  length = 0;
+  size_t failed = get_failed_start(tasks, input_size);
+  if (failed < input_size)
+    return make_status(ERROR_MALFORMED_INPUT, failed+find_malformed(data+failed, input_size-failed, encoding));
+
+  // or add up the counts
+  for (size_t i = 0; i < tasks.size(); i++)
+    length += tasks[i].length;
+  return make_status(ERROR_NONE, input_size);
+}
+
+status utf::try_convert_encoding_parallel(const string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, unsigned int thread_count) UTF_NOEXCEPT {
+  return try_convert_encoding_parallel(input.data(), input.size(), input_encoding, output_encoding, include_bom, output, thread_count);
+}
+
+status utf::try_convert_encoding_parallel(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, unsigned int thread_count) UTF_NOEXCEPT {
+  // basic error checking, and small strings aren't worth splitting
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = get_bom_size(data, input_size, input_encoding);
+  size_t count = get_thread_count(input_size-pos, thread_count);
+  if (count == 1 || check_encodings(input_encoding, output_encoding) != ERROR_NONE)
+    return try_convert_encoding(input, input_size, input_encoding, output_encoding, include_bom, output);
+
+  // find the converted size of each piece after the BOM at once, and find the error from the first piece that has one
+  vector<parallel_task> tasks = split_tasks(data+pos, input_size-pos, input_encoding, output_encoding, count);
+  run_tasks(measure_task, tasks);
+  size_t failed = pos+get_failed_start(tasks, input_size-pos);
+  if (failed < input_size) {
+    size_t measured_size;
+    status measured = measure_units(data+failed, input_size-failed, input_encoding, output_encoding, measured_size);
+    return make_status(measured.error, failed+measured.offset);
   }
 
-  // unknown input encoding
-  throw encode_error("unknown input encoding");
-  return 0;
+  // add the BOM if necessary, and place each piece after the ones before it
+  size_t bom_size = 0;
+  const char *bom = get_bom(output_encoding, bom_size);
+  if (!include_bom)
+    bom_size = 0;
+  size_t output_size = bom_size;
+  for (size_t i = 0; i < tasks.size(); i++)
+    output_size += tasks[i].output_size;
+  size_t start = output.size();
+  output.resize(start+output_size);
+  uint8_t *result = (uint8_t *)&output[0]+start;
+  memcpy(result, bom, bom_size);
+  size_t output_pos = bom_size;
+  for (size_t i = 0; i < tasks.size(); i++) {
+    tasks[i].output = result+output_pos;
+    output_pos += tasks[i].output_size;
+  }
+
+  // and convert the pieces at once (the input is valid, so there are no errors)
+  run_tasks(convert_task, tasks);
+  return make_status(ERROR_NONE, input_size);
 }
 
-uint32_t utf::get_char(const string &input, size_t pos, encoding_type encoding) {
-  // make sure there is a character at pos
-  size_t size = get_char_size(input, pos, encoding);
-  if (size == 0)
-    throw encode_error("index does not refer to a valid code point");
-  // ASCII
-  if (encoding == ENCODING_ASCII)
-    return (unsigned char)input[pos];
+void utf::convert_batch(const char *input, const size_t *offsets, size_t count, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, vector<size_t> &output_offsets, unsigned int thread_count) {
+  status result = try_convert_batch(input, offsets, count, input_encoding, output_encoding, include_bom, output, output_offsets, thread_count);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
+}
 
-  // UTF8
-  if (encoding == ENCODING_UTF8) {
-    if (size == 1)
-      return input[pos];
-    if (size == 2)
-      return ((((uint8_t)input[pos])&0x1F)<<6)+(((uint8_t)input[pos+1])&0x3F);
-    if (size == 3)
-      return ((((uint8_t)input[pos])&0x0F)<<12)+((((uint8_t)input[pos+1])&0x3F)<<6)+(((uint8_t)input[pos+2])&0x3F);
-    if (size == 4)
-      return ((((uint8_t)input[pos])&0x07)<<18)+((((uint8_t)input[pos+1])&0x3F)<<12)+((((uint8_t)input[pos+2])&0x3F)<<6)+(((uint8_t)input[pos+3])&0x3F);
+status utf::try_convert_batch(const char *input, const size_t *offsets, size_t count, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, string &output, vector<size_t> &output_offsets, unsigned int thread_count) UTF_NOEXCEPT {
+  // basic error checking, done once for all the strings
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, offsets[0]);
+
+  // convert the strings on the calling thread straight into the output
+  const uint8_t *data = (const uint8_t *)input;
+  size_t threads = get_thread_count(offsets[count]-offsets[0], thread_count);
+  if (threads == 1 || count < 2) {
+    vector<size_t> converted_offsets(count+1);
+    status result = convert_strings(data, offsets, 0, count, input_encoding, output_encoding, include_bom, output, &converted_offsets[0]);
+    if (result.error == ERROR_NONE)
+      output_offsets.swap(converted_offsets);
+    return result;
   }
 
-  // UTF16BE
-  if (encoding == ENCODING_UTF16BE) {
-    if (size == 2)
-      return (((uint8_t)input[pos])<<8)+((uint8_t)input[pos+1]);
-    if (size == 4)
-      return 0x10000+((((((uint8_t)input[pos])<<8)+((uint8_t)input[pos+1]))-0xD800)<<10)+(((((uint8_t)input[pos+2])<<8)+((uint8_t)input[pos+3]))-0xDC00);
+  // or give each thread about the same number of bytes, without splitting a string
+  vector<batch_task> tasks;
+  size_t first = 0;
+  for (size_t i = 1; i <= threads && first < count; i++) {
+    size_t target = offsets[0]+(offsets[count]-offsets[0])/threads*i;
+    size_t last = i == threads ? count : lower_bound(offsets+first+1, offsets+count, target)-offsets;
+    batch_task task;
+    task.data = data;
+    task.offsets = offsets;
+    task.first = first;
+    task.last = last;
+    task.input_encoding = input_encoding;
+    task.output_encoding = output_encoding;
+    task.include_bom = include_bom;
+    tasks.push_back(task);
+    first = last;
   }
+  run_tasks(convert_batch_task, tasks);
 
-  // UTF16LE
-  if (encoding == ENCODING_UTF16LE) {
-    if (size == 2)
-      return (((uint8_t)input[pos+1])<<8)+((uint8_t)input[pos]);
-    if (size == 4)
-      return 0x10000+((((((uint8_t)input[pos+1])<<8)+((uint8_t)input[pos]))-0xD800)<<10)+(((((uint8_t)input[pos+3])<<8)+((uint8_t)input[pos+2]))-0xDC00);
+  // report the first error, since the strings don't depend on each other
+  for (size_t i = 0; i < tasks.size(); i++) {
+    if (tasks[i].result.error != ERROR_NONE)
+      return tasks[i].result;
   }
 
-  // UTF32BE
-  if (encoding == ENCODING_UTF32BE)
-    return (((uint8_t)input[pos])<<24)+(((uint8_t)input[pos+1])<<16)+(((uint8_t)input[pos+2])<<8)+((uint8_t)input[pos+3]);
+  // and put the pieces together
+  size_t start = output.size();
+  size_t output_size = 0;
+  for (size_t i = 0; i < tasks.size(); i++)
+    output_size += tasks[i].output.size();
+  output.reserve(start+output_size);
+  output_offsets.resize(count+1);
+  for (size_t i = 0; i < tasks.size(); i++) {
+    size_t shift = output.size();
+    for (size_t j = tasks[i].first; j <= tasks[i].last; j++)
+      output_offsets[j] = shift+tasks[i].output_offsets[j-tasks[i].first];
+    output.append(tasks[i].output);
+  }
+  return make_status(ERROR_NONE, offsets[count]);
+}
 
-  // UTF32LE
-  if (encoding == ENCODING_UTF32LE)
-    return (((uint8_t)input[pos+3])<<24)+(((uint8_t)input[pos+2])<<16)+(((uint8_t)input[pos+1])<<8)+((uint8_t)input[pos]);
+status utf::validate_batch(const char *input, const size_t *offsets, size_t count, encoding_type encoding, size_t &length, unsigned int thread_count) UTF_NOEXCEPT {
+  // validate the whole column in one pass, and then make sure no code point crosses from one string into the next
+  const uint8_t *data = (const uint8_t *)input+offsets[0];
+  size_t size = offsets[count]-offsets[0];
+  status result = validate_parallel((const char *)data, size, encoding, length, thread_count);
+  if (result.error == ERROR_UNKNOWN_INPUT_ENCODING)
+    return make_status(result.error, offsets[0]);
+  bool aligned = result.error == ERROR_NONE;
+  for (size_t i = 1; i < count && aligned; i++)
+    aligned = align_char(data, size, offsets[i]-offsets[0], encoding) == offsets[i]-offsets[0];
+  if (aligned)
+    return make_status(ERROR_NONE, offsets[count]);
+
+  // otherwise find the first string with an error
+  length = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t string_size = offsets[i+1]-offsets[i];
+    size_t malformed = find_malformed((const uint8_t *)input+offsets[i], string_size, encoding);
+    if (malformed < string_size)
+      return make_status(ERROR_MALFORMED_INPUT, offsets[i]+malformed);
+  }
+  return make_status(ERROR_NONE, offsets[count]);
+}
 
-  // unknown input encoding
-  throw encode_error("unknown input encoding");
-  return 0;
+utf::stream_converter::stream_converter(encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+  this->input_encoding = input_encoding;
+  this->output_encoding = output_encoding;
+  this->include_bom = include_bom;
+  reset();
 }
 
-void utf::set_char(string &input, size_t pos, uint32_t code_point, encoding_type encoding) {
-  // get the size of the code point to replace
-  size_t old_size = get_char_size(input, pos, encoding);
+void utf::stream_converter::feed(const char *input, size_t input_size, string &output) {
+  status result = try_feed(input, input_size, output);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
+}
 
-  // make sure the code point is valid
-  if (old_size == 0)
-    throw encode_error("index does not refer to a valid code point");
+void utf::stream_converter::feed(const string &input, string &output) {
+  feed(input.data(), input.size(), output);
+}
 
-  // get the size of the new code point
-  string new_code_point;
-  add_char(new_code_point, code_point, encoding);
-  if (old_size == new_code_point.size()) {
-    for (size_t i = 0; i < old_size; i++)
-      input[pos+i] = new_code_point[i];
-  } else
-    input = input.substr(0, pos)+new_code_point+input.substr(pos+new_code_point.size(), input.size()-(pos+new_code_point.size()));
+void utf::stream_converter::flush(string &output) {
+  status result = try_flush(output);
+  if (result.error != ERROR_NONE)
+    UTF_THROW(get_error_message(result.error, output_encoding));
 }
 
-void utf::add_char(string &input, uint32_t code_point, encoding_type encoding) {
-  // make sure the code point is within the valid range
-  if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+void utf::stream_converter::reset() {
+  pending_size = 0;
+  position = 0;
+  at_start = true;
+  bom_written = false;
+}
 
-  // ASCII
-  if (encoding == ENCODING_ASCII) {
-    // make sure the code point is within the valid range
-    if ((unsigned char)code_point > 127)
-      throw encode_error("invalid code point for ASCII");
+status utf::stream_converter::try_feed(const char *input, size_t input_size, string &output) UTF_NOEXCEPT {
+  // basic error checking
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, position);
+
+  // start the output with the BOM if necessary
+  size_t start = output.size();
+  if (include_bom && !bom_written) {
+    size_t bom_size;
+    const char *bom = get_bom(output_encoding, bom_size);
+    output.append(bom, bom_size);
+    bom_written = true;
+  }
 
-    // add the code point
-    input.push_back(code_point);
-    return;
+  // skip the BOM at the start of the stream, which may itself be split between chunks
+  const uint8_t *data = (const uint8_t *)input;
+  size_t pos = 0;
+  if (at_start) {
+    size_t bom_size;
+    const char *bom = get_bom(input_encoding, bom_size);
+    while (pos < input_size && pending_size < bom_size && data[pos] == (uint8_t)bom[pending_size])
+      pending[pending_size++] = data[pos++];
+    if (pending_size == bom_size) {
+      pending_size = 0;
+      at_start = false;
+    } else if (pos < input_size)
+      at_start = false;
   }
 
-  // UTF8
-  if (encoding == ENCODING_UTF8) {
-    // one byte
-    if (code_point <= 0x0000007F) {
-      input.push_back(code_point);
-      return;
+  // complete the code point carried over from the last chunk one byte at a time (it takes at most 4), and convert it
+  if (pending_size > 0 && !at_start) {
+    while (pos < input_size && get_incomplete_size(pending, pending_size, input_encoding) == pending_size)
+      pending[pending_size++] = data[pos++];
+    if (get_incomplete_size(pending, pending_size, input_encoding) < pending_size) {
+      status converted = append_units(pending, pending_size, input_encoding, output_encoding, output);
+      if (converted.error != ERROR_NONE) {
+        output.resize(start);
+        return make_status(converted.error, position-(pending_size-pos)+converted.offset);
+      }
+      pending_size = 0;
     }
+  }
 
-    // two bytes
-    if (code_point >= 0x00000080 && code_point <= 0x000007FF) {
-      input.push_back(0xC0+(code_point>>6));
-      input.push_back(0x80+(code_point&0x3F));
-      return;
+  // convert the rest, except for a code point cut off at the end, which is carried over to the next chunk
+  if (pending_size == 0) {
+    size_t end = input_size-get_incomplete_size(data+pos, input_size-pos, input_encoding);
+    status converted = append_units(data+pos, end-pos, input_encoding, output_encoding, output);
+    if (converted.error != ERROR_NONE) {
+      output.resize(start);
+      return make_status(converted.error, position+pos+converted.offset);
     }
+    memcpy(pending, data+end, input_size-end);
+    pending_size = input_size-end;
+  }
+  position += input_size;
+  return make_status(ERROR_NONE, position);
+}
 
-    // three bytes
-    if (code_point >= 0x00000800 && code_point <= 0x0000FFFF) {
-      input.push_back(0xE0+(code_point>>12));
-      input.push_back(0x80+((code_point>>6)&0x3F));
-      input.push_back(0x80+(code_point&0x3F));
-      return;
-    }
+status utf::stream_converter::try_flush(string &output) UTF_NOEXCEPT {
+  // basic error checking
+  error_type error = check_encodings(input_encoding, output_encoding);
+  if (error != ERROR_NONE)
+    return make_status(error, position);
+
+  // anything carried over is the start of a code point that never ends
+  if (pending_size > 0)
+    return make_status(ERROR_MALFORMED_INPUT, position-pending_size);
+
+  // an empty stream still gets the BOM
+  if (include_bom && !bom_written) {
+    size_t bom_size;
+    const char *bom = get_bom(output_encoding, bom_size);
+    output.append(bom, bom_size);
+  }
+  size_t stream_size = position;
+  reset();
+  return make_status(ERROR_NONE, stream_size);
+}
+
+utf::transcoding_streambuf::transcoding_streambuf(streambuf *underlying, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t block_size) :
+  underlying(underlying),
+  reader(input_encoding, output_encoding, include_bom),
+  writer(input_encoding, output_encoding, include_bom),
+  error(make_status(ERROR_NONE, 0)),
+  raw_input(block_size > 0 ? block_size : 1, '\0'),
+  output(block_size > 0 ? block_size : 1, '\0'),
+  input_finished(false),
+  output_started(false) {
+  // nothing has been read yet, and the put area is the whole output block
+  setg(0, 0, 0);
+  setp(&output[0], &output[0]+output.size());
+}
 
-    // four bytes
-    if (code_point >= 0x00010000 && code_point <= 0x0010FFFF) {
-      input.push_back(0xF0+(code_point>>18));
-      input.push_back(0x80+((code_point>>12)&0x3F));
-      input.push_back(0x80+((code_point>>6)&0x3F));
-      input.push_back(0x80+(code_point&0x3F));
-      return;
+utf::transcoding_streambuf::~transcoding_streambuf() {
+  if (output_started || pptr() > pbase())
+    finish();
+}
+
+bool utf::transcoding_streambuf::finish() {
+  // if nothing was written since the output was last finished, there's nothing to end (not even with a BOM)
+  if (!output_started && pptr() == pbase())
+    return error.error == ERROR_NONE && underlying->pubsync() == 0;
+
+  // convert what's left, and make sure it doesn't end in the middle of a code point
+  if (!write_block(0, 0))
+    return false;
+  converted_output.clear();
+  status result = writer.try_flush(converted_output);
+  if (result.error != ERROR_NONE) {
+    error = result;
+    return false;
+  }
+  output_started = false;
+  if (underlying->sputn(converted_output.data(), converted_output.size()) != (streamsize)converted_output.size())
+    return false;
+  return underlying->pubsync() == 0;
+}
+
+status utf::transcoding_streambuf::get_status() const {
+  return error;
+}
+
+utf::transcoding_streambuf::int_type utf::transcoding_streambuf::underflow() {
+  // use what's left of the last block first
+  if (gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+
+  // read and convert blocks until one produces some output (a block may end up entirely carried over to the next)
+  while (error.error == ERROR_NONE && !input_finished) {
+    input.clear();
+    streamsize read = underlying->sgetn(&raw_input[0], raw_input.size());
+    status result;
+    if (read > 0)
+      result = reader.try_feed(raw_input.data(), read, input);
+    else {
+      result = reader.try_flush(input);
+      input_finished = true;
+    }
+    if (result.error != ERROR_NONE) {
+      error = result;
+      break;
+    }
+    if (!input.empty()) {
+      setg(&input[0], &input[0], &input[0]+input.size());
+      return traits_type::to_int_type(*gptr());
     }
   }
+  setg(0, 0, 0);
+  return traits_type::eof();
+}
 
-  // UTF16BE
-  if (encoding == ENCODING_UTF16BE) {
-    if (code_point >= 0xD800 && code_point <= 0xDFFF)
-      throw encode_error("unable to encode code points U+D800 to U+DFFF in UTF-16");
-    if (code_point <= 0xD7FF || (code_point >= 0xE000 && code_point <= 0xFFFF)) {
-      input.push_back(code_point>>8);
-      input.push_back(code_point&0xFF);
-      return;
-    }
-    code_point -= 0x10000;
-    uint16_t high = (code_point>>10)+0xD800;
-    uint16_t low = (code_point&0x3FF)+0xDC00;
-    input.push_back(high>>8);
-    input.push_back(high&0xFF);
-    input.push_back(low>>8);
-    input.push_back(low&0xFF);
-    return;
-  }
-
-  // UTF16LE
-  if (encoding == ENCODING_UTF16LE) {
-    if (code_point >= 0xD800 && code_point <= 0xDFFF)
-      throw encode_error("unable to encode code points U+D800 to U+DFFF in UTF-16");
-    if (code_point <= 0xD7FF || (code_point >= 0xE000 && code_point <= 0xFFFF)) {
-      input.push_back(code_point&0xFF);
-      input.push_back(code_point>>8);
-      return;
-    }
-    code_point -= 0x10000;
-    uint16_t high = (code_point>>10)+0xD800;
-    uint16_t low = (code_point&0x3FF)+0xDC00;
-    input.push_back(high&0xFF);
-    input.push_back(high>>8);
-    input.push_back(low&0xFF);
-    input.push_back(low>>8);
-    return;
-  }
-
-  // UTF32BE
-  if (encoding == ENCODING_UTF32BE) {
-    input.push_back(code_point>>24);
-    input.push_back((code_point>>16)&0xFF);
-    input.push_back((code_point>>8)&0xFF);
-    input.push_back(code_point&0xFF);
-    return;
+utf::transcoding_streambuf::int_type utf::transcoding_streambuf::overflow(int_type c) {
+  // make room in the put area, and then put the character there
+  if (!write_block(0, 0))
+    return traits_type::eof();
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+streamsize utf::transcoding_streambuf::xsputn(const char *s, streamsize n) {
+  // copy small writes into the put area, and convert large ones directly
+  if (n < epptr()-pptr()) {
+    memcpy(pptr(), s, n);
+    pbump((int)n);
+    return n;
   }
+  return write_block(s, n) ? n : 0;
+}
 
-  // UTF32LE
-  if (encoding == ENCODING_UTF32LE) {
-    input.push_back(code_point&0xFF);
-    input.push_back((code_point>>8)&0xFF);
-    input.push_back((code_point>>16)&0xFF);
-    input.push_back(code_point>>24);
-    return;
+int utf::transcoding_streambuf::sync() {
+  // write everything that can be converted so far (a code point cut off at the end stays in the converter)
+  if (!write_block(0, 0))
+    return -1;
+  return underlying->pubsync();
+}
+
+bool utf::transcoding_streambuf::write_block(const char *data, size_t size) {
+  // basic error checking
+  if (error.error != ERROR_NONE)
+    return false;
+
+  // a flush with nothing to convert doesn't count as output (and would start it with a BOM)
+  if (pptr() == pbase() && size == 0)
+    return true;
+  output_started = true;
+
+  // convert the put area and the given data
+  converted_output.clear();
+  status result = writer.try_feed(pbase(), pptr()-pbase(), converted_output);
+  if (result.error == ERROR_NONE && size > 0)
+    result = writer.try_feed(data, size, converted_output);
+  setp(&output[0], &output[0]+output.size());
+  if (result.error != ERROR_NONE) {
+    error = result;
+    return false;
   }
+
+  // write the result
+  return underlying->sputn(converted_output.data(), converted_output.size()) == (streamsize)converted_output.size();
 }
 
 bool utf::is_alpha(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point)
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_ALPHA) != 0;
 }
 
 bool utf::is_upper(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point && letters[i].character_case == CASE_UPPER)
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_CASE) == CASE_UPPER;
 }
 
 bool utf::is_lower(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point && letters[i].character_case == CASE_LOWER)
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_CASE) == CASE_LOWER;
 }
 
 bool utf::is_title(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point && letters[i].character_case == CASE_TITLE)
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_CASE) == CASE_TITLE;
 }
 
 bool utf::is_numeric(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_NUMBERS; i++) {
-    if (code_point == numbers[i])
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_NUMERIC) != 0;
 }
 
 bool utf::is_whitespace(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_WHITESPACE; i++) {
-    if (code_point == whitespace[i])
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_WHITESPACE) != 0;
 }
 
 bool utf::is_newline(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_NEWLINES; i++) {
-    if (code_point == newlines[i])
-      return true;
-  }
-  return false;
+  // look up the properties
+  return (get_properties(code_point).flags&PROPERTY_NEWLINE) != 0;
 }
 
 uint32_t utf::to_upper(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point) {
-      if (letters[i].upper_version != CODE_POINT_NULL)
-        return letters[i].upper_version;
-      break;
-    }
-  }
-  return code_point;
+  // apply the case mapping offset (0 if there is no uppercase form)
+  return code_point+get_properties(code_point).upper_delta;
 }
 
 uint32_t utf::to_lower(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point) {
-      if (letters[i].lower_version != CODE_POINT_NULL)
-        return letters[i].lower_version;
-      break;
-    }
-  }
-  return code_point;
+  // apply the case mapping offset (0 if there is no lowercase form)
+  return code_point+get_properties(code_point).lower_delta;
 }
 
 uint32_t utf::to_title(uint32_t code_point) {
   // make sure the code point is within the valid range
   if (code_point > 0x10FFFF)
-    throw encode_error("invalid code point");
+    UTF_THROW("invalid code point");
 
-  // search the table
-  for (size_t i = 0; i < NUM_LETTERS; i++) {
-    if (code_point == letters[i].code_point) {
-      if (letters[i].title_version != CODE_POINT_NULL)
-        return letters[i].title_version;
-      break;
-    }
-  }
-  return code_point;
+  // apply the case mapping offset (0 if there is no titlecase form)
+  return code_point+get_properties(code_point).title_delta;
 }
\ No newline at end of file
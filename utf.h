@@ -6,7 +6,40 @@
 #define UTF_H
 
 #include <string>
+#include <iterator>
+#include <streambuf>
+#include <vector>
+#include <stddef.h>
 #include <stdint.h>
+#if __cplusplus >= 201703L
+  #include <string_view>
+#endif
+#if __cplusplus >= 202002L
+  #include <ranges>
+#endif
+
+// the functions that return a status never throw (so running out of memory in one, such as while it grows an output
+// string, terminates the program)
+#if __cplusplus >= 201103L
+  #define UTF_NOEXCEPT noexcept
+#else
+  #define UTF_NOEXCEPT throw()
+#endif
+
+// the codecs can be evaluated at compile time where the language allows it
+#if __cplusplus >= 201402L
+  #define UTF_CONSTEXPR constexpr
+#else
+  #define UTF_CONSTEXPR inline
+#endif
+
+// the unchecked functions check that their input is well-formed with assert when UTF_DEBUG_UNCHECKED is defined
+#ifdef UTF_DEBUG_UNCHECKED
+  #include <assert.h>
+  #define UTF_ASSUME_VALID(condition) assert(condition)
+#else
+  #define UTF_ASSUME_VALID(condition) ((void)0)
+#endif
 
 namespace utf {
 
@@ -35,23 +68,142 @@ namespace utf {
     ENCODING_UTF32LE,
   };
 
-  // detect the encoding for a string
+  // error codes for the functions that return a status instead of throwing an exception
+  enum error_type {
+    ERROR_NONE,
+    ERROR_UNKNOWN_INPUT_ENCODING,
+    ERROR_UNKNOWN_OUTPUT_ENCODING,
+    ERROR_MALFORMED_INPUT,
+    ERROR_INVALID_CODE_POINT,
+    ERROR_UNENCODABLE_CODE_POINT,
+    ERROR_INDEX_OUT_OF_RANGE,
+    ERROR_INVALID_INDEX,
+    ERROR_OUTPUT_TOO_SMALL,
+  };
+
+  // the result of a function that returns a status instead of throwing an exception
+  struct status {
+    // the error, or ERROR_NONE on success
+    error_type error;
+
+    // the byte offset in the input where the error was found
+    size_t offset;
+  };
+
+  // an encoding that a string may be in
+  struct encoding_candidate {
+    // the encoding
+    encoding_type encoding;
+
+    // how likely the string is to be in the encoding, from 0 to 1
+    double confidence;
+  };
+
+  // a string converted to UTF-8 by normalize_to_utf8, which points into the input if it was ASCII or UTF-8 already
+  // (after its BOM), and otherwise holds a converted copy
+  class normalized_utf8 {
+    public:
+      // constructor (empty)
+      normalized_utf8();
+
+      // get the UTF-8 text, which is only valid as long as the input is if it isn't a copy
+      const char *data() const;
+      size_t size() const;
+      std::string str() const;
+
+      // get the encoding the input was in, and whether the text is a converted copy
+      encoding_type get_encoding() const;
+      bool is_copy() const;
+
+#if __cplusplus >= 201703L
+      // view the UTF-8 text
+      operator std::string_view() const {
+        return std::string_view(data(), size());
+      }
+#endif
+
+    private:
+      friend status try_normalize_to_utf8(const char *input, size_t input_size, normalized_utf8 &output) UTF_NOEXCEPT;
+
+      // the text in the input, if it isn't a copy
+      const char *text;
+      size_t text_size;
+
+      // the converted text, if it is a copy
+      std::string converted;
+      bool copied;
+
+      // the encoding of the input
+      encoding_type encoding;
+  };
+
+  // detect the encoding for a string (the first encoding from detect_encodings if its confidence is at least 0.5, or
+  // else ASCII or UTF-8 if the string is valid in either, or else ENCODING_UNKNOWN; since zero bytes point to UTF-16 or
+  // UTF-32 without a BOM, a string such as "a\0" or "\0\0\0\0" is detected as one of those even though it is valid
+  // ASCII)
   encoding_type detect_encoding(const std::string &input);
+  encoding_type detect_encoding(const char *input, size_t input_size);
+
+  // list the encodings a string is valid in, most likely first, checking all of them in a single pass over the string,
+  // or over only about sample_size bytes of a longer one if sample_size is not 0 (half from the start and the rest from
+  // windows spread evenly over the remainder, so the string may be malformed in the parts that aren't read); a BOM gives
+  // its encoding a confidence of 1, and otherwise the confidence comes from where the zero bytes are, which is how UTF-16
+  // and UTF-32 without a BOM are recognized
+  std::vector<encoding_candidate> detect_encodings(const std::string &input, size_t sample_size = 0);
+  std::vector<encoding_candidate> detect_encodings(const char *input, size_t input_size, size_t sample_size = 0);
+
+  // detect the encoding of a string as detect_encoding does, and convert it to UTF-8 without its BOM, reading it only
+  // once if it is ASCII or UTF-8 (in which case the result points into it without copying) or starts with a BOM
+  normalized_utf8 normalize_to_utf8(const std::string &input);
+  normalized_utf8 normalize_to_utf8(const char *input, size_t input_size);
 
   // determine whether a string is valid in a particular encoding
   bool is_valid(const std::string &input, encoding_type encoding);
+  bool is_valid(const char *input, size_t input_size, encoding_type encoding);
+
+  // determine whether a string is valid in a particular encoding and count its code points in the same pass (length is only meaningful if the string is valid)
+  bool is_valid(const std::string &input, encoding_type encoding, size_t &length);
+  bool is_valid(const char *input, size_t input_size, encoding_type encoding, size_t &length);
 
   // convert a string from one encoding to another
   std::string convert_encoding(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+  std::string convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+
+  // convert a string from one encoding to another, appending the result to output (which is left as it was if there is an error)
+  void convert_encoding(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output);
+  void convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output);
+
+  // convert a string from one encoding to another into a buffer and return the number of bytes written (get_converted_size gives the capacity needed)
+  size_t convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, char *output, size_t output_capacity);
+
+  // get the exact number of bytes that converting a string from one encoding to another produces, without converting it
+  size_t get_converted_size(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+  size_t get_converted_size(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
 
   // get the number of code points in a string
   size_t get_length(const std::string &input, encoding_type encoding);
+  size_t get_length(const char *input, size_t input_size, encoding_type encoding);
 
   // return the number of bytes of the code point at pos, or 0 if the byte index does not refer to a valid code point
   size_t get_char_size(const std::string &input, size_t pos, encoding_type encoding);
+  size_t get_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding);
 
   // get the code point at a particular byte index
   uint32_t get_char(const std::string &input, size_t pos, encoding_type encoding);
+  uint32_t get_char(const char *input, size_t input_size, size_t pos, encoding_type encoding);
+
+  // return the number of bytes of the code point that ends at pos, or 0 if the bytes before pos are not a valid code point
+  size_t get_prev_char_size(const std::string &input, size_t pos, encoding_type encoding);
+  size_t get_prev_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding);
+
+  // get the code point that ends at a particular byte index
+  uint32_t get_prev_char(const std::string &input, size_t pos, encoding_type encoding);
+  uint32_t get_prev_char(const char *input, size_t input_size, size_t pos, encoding_type encoding);
+
+  // get the byte index of the start of the code point that contains pos, in constant time (pos itself if a code point
+  // starts there or it is the end of the string; a malformed sequence may leave pos inside it)
+  size_t align_to_boundary(const std::string &input, size_t pos, encoding_type encoding);
+  size_t align_to_boundary(const char *input, size_t input_size, size_t pos, encoding_type encoding);
 
   // set the code point at a particular byte index
   void set_char(std::string &input, size_t pos, uint32_t code_point, encoding_type encoding);
@@ -59,6 +211,166 @@ namespace utf {
   // add a code point to the end of a string
   void add_char(std::string &input, uint32_t code_point, encoding_type encoding);
 
+  // convert a string from one encoding to another without failing on bad input: each maximal malformed sequence (the
+  // longest start of a code point that could still have been completed) and each code point the output encoding can't
+  // represent becomes U+FFFD, or '?' in ASCII, as recommended by Unicode and WHATWG
+  std::string convert_encoding_lossy(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+  std::string convert_encoding_lossy(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+
+  // replace each maximal malformed sequence in a string with U+FFFD in place, leaving a valid string untouched, and
+  // return the number of replacements
+  size_t repair(std::string &input, encoding_type encoding);
+
+  // validate a string and count its code points, returning the offset of the first malformed code point on error
+  status validate(const std::string &input, encoding_type encoding, size_t &length) UTF_NOEXCEPT;
+  status validate(const char *input, size_t input_size, encoding_type encoding, size_t &length) UTF_NOEXCEPT;
+
+  // the versions of convert_encoding, is_valid and validate for large strings, which split the string at code point
+  // boundaries and process the pieces on up to thread_count threads at once (0 for one per core), with the same result
+  // and error offset as the single-threaded versions
+  std::string convert_encoding_parallel(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, unsigned int thread_count = 0);
+  std::string convert_encoding_parallel(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, unsigned int thread_count = 0);
+  bool is_valid_parallel(const std::string &input, encoding_type encoding, unsigned int thread_count = 0);
+  bool is_valid_parallel(const char *input, size_t input_size, encoding_type encoding, unsigned int thread_count = 0);
+  status validate_parallel(const std::string &input, encoding_type encoding, size_t &length, unsigned int thread_count = 0) UTF_NOEXCEPT;
+  status validate_parallel(const char *input, size_t input_size, encoding_type encoding, size_t &length, unsigned int thread_count = 0) UTF_NOEXCEPT;
+  status try_convert_encoding_parallel(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, unsigned int thread_count = 0) UTF_NOEXCEPT;
+  status try_convert_encoding_parallel(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, unsigned int thread_count = 0) UTF_NOEXCEPT;
+
+  // the versions of convert_encoding and validate for a column of many strings stored one after another in input, where
+  // string i runs from offsets[i] to offsets[i+1] (offsets has count+1 entries); each string is converted as if by
+  // convert_encoding, into output laid out the same way, with output_offsets set to count+1 offsets into output, the
+  // length is the total number of code points, the offset of an error is from the start of input, and the strings are
+  // split between up to thread_count threads (0 for one per core)
+  void convert_batch(const char *input, const size_t *offsets, size_t count, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, std::vector<size_t> &output_offsets, unsigned int thread_count = 1);
+  status try_convert_batch(const char *input, const size_t *offsets, size_t count, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, std::vector<size_t> &output_offsets, unsigned int thread_count = 1) UTF_NOEXCEPT;
+  status validate_batch(const char *input, const size_t *offsets, size_t count, encoding_type encoding, size_t &length, unsigned int thread_count = 1) UTF_NOEXCEPT;
+
+  // the versions of the functions above that return a status instead of throwing an exception (with exceptions disabled,
+  // the throwing versions abort instead; a failed allocation is not reported in the status, and terminates the program)
+  status try_convert_encoding(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output) UTF_NOEXCEPT;
+  status try_convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output) UTF_NOEXCEPT;
+  status try_convert_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, char *output, size_t output_capacity, size_t &output_size) UTF_NOEXCEPT;
+  status try_get_converted_size(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t &output_size) UTF_NOEXCEPT;
+  status try_get_converted_size(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t &output_size) UTF_NOEXCEPT;
+  status try_get_length(const std::string &input, encoding_type encoding, size_t &length) UTF_NOEXCEPT;
+  status try_get_length(const char *input, size_t input_size, encoding_type encoding, size_t &length) UTF_NOEXCEPT;
+  status try_get_char_size(const std::string &input, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT;
+  status try_get_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT;
+  status try_get_char(const std::string &input, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT;
+  status try_get_char(const char *input, size_t input_size, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT;
+  status try_get_prev_char_size(const std::string &input, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT;
+  status try_get_prev_char_size(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &size) UTF_NOEXCEPT;
+  status try_get_prev_char(const std::string &input, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT;
+  status try_get_prev_char(const char *input, size_t input_size, size_t pos, encoding_type encoding, uint32_t &code_point) UTF_NOEXCEPT;
+  status try_align_to_boundary(const std::string &input, size_t pos, encoding_type encoding, size_t &boundary) UTF_NOEXCEPT;
+  status try_align_to_boundary(const char *input, size_t input_size, size_t pos, encoding_type encoding, size_t &boundary) UTF_NOEXCEPT;
+  status try_add_char(std::string &input, uint32_t code_point, encoding_type encoding) UTF_NOEXCEPT;
+  status try_convert_encoding_lossy(const std::string &input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, size_t &replacements) UTF_NOEXCEPT;
+  status try_convert_encoding_lossy(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output, size_t &replacements) UTF_NOEXCEPT;
+  status try_normalize_to_utf8(const std::string &input, normalized_utf8 &output) UTF_NOEXCEPT;
+  status try_normalize_to_utf8(const char *input, size_t input_size, normalized_utf8 &output) UTF_NOEXCEPT;
+
+  // convert a stream that arrives in chunks from one encoding to another, carrying a code point (or input BOM) that is
+  // split between chunks over to the next one, so memory use doesn't grow with the stream
+  class stream_converter {
+    public:
+      // constructor
+      stream_converter(encoding_type input_encoding, encoding_type output_encoding, bool include_bom);
+
+      // convert a chunk, appending the result to output (which is left as it was if there is an error)
+      void feed(const char *input, size_t input_size, std::string &output);
+      void feed(const std::string &input, std::string &output);
+
+      // end the stream, making sure it doesn't end in the middle of a code point, and get ready for a new one
+      void flush(std::string &output);
+
+      // start a new stream, dropping anything carried over (needed after an error)
+      void reset();
+
+      // the versions of feed and flush that return a status instead of throwing an exception (the offset of an error
+      // is from the start of the stream)
+      status try_feed(const char *input, size_t input_size, std::string &output) UTF_NOEXCEPT;
+      status try_flush(std::string &output) UTF_NOEXCEPT;
+
+    private:
+      // the encodings, and whether to start the output with a BOM
+      encoding_type input_encoding;
+      encoding_type output_encoding;
+      bool include_bom;
+
+      // the bytes at the end of the stream so far that don't make up a whole code point yet
+      uint8_t pending[4];
+      size_t pending_size;
+
+      // the number of bytes fed since the start of the stream
+      size_t position;
+
+      // whether the stream may still start with a BOM, and whether the output BOM has been written
+      bool at_start;
+      bool bom_written;
+  };
+
+  // a stream buffer that converts between encodings as it reads from or writes to another one, a block at a time, so
+  // iostream code can read or write text in any encoding (reading converts from the input encoding of the underlying
+  // buffer to the output encoding, and writing converts what is written from the input encoding to the output encoding
+  // of the underlying buffer)
+  class transcoding_streambuf : public std::streambuf {
+    public:
+      // constructor (the underlying buffer must outlive this one)
+      transcoding_streambuf(std::streambuf *underlying, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, size_t block_size = 65536);
+
+      // destructor (finishes the output if anything was written)
+      ~transcoding_streambuf();
+
+      // end the output, making sure it doesn't end in the middle of a code point, and flush the underlying buffer
+      // (returns false if there is an error); like the destructor, this writes nothing if nothing was written since the
+      // output was last finished, so a BOM is only written with some text after it
+      bool finish();
+
+      // get the first error that stopped reading or writing (ERROR_NONE if there wasn't one), with its offset from the
+      // start of the unconverted stream
+      status get_status() const;
+
+    protected:
+      // refill the get area with the next converted block
+      int_type underflow();
+
+      // convert the put area and write it to the underlying buffer
+      int_type overflow(int_type c);
+      std::streamsize xsputn(const char *s, std::streamsize n);
+      int sync();
+
+    private:
+      // convert the put area, and then the given data, and write the result to the underlying buffer
+      bool write_block(const char *data, size_t size);
+
+      // not copyable
+      transcoding_streambuf(const transcoding_streambuf &other);
+      transcoding_streambuf &operator=(const transcoding_streambuf &other);
+
+      // the buffer being read from or written to
+      std::streambuf *underlying;
+
+      // the converters for each direction, and the first error
+      stream_converter reader;
+      stream_converter writer;
+      status error;
+
+      // the bytes read from the underlying buffer, the converted bytes being read, and the bytes written but not
+      // converted yet
+      std::string raw_input;
+      std::string input;
+      std::string output;
+
+      // the converted bytes to be written to the underlying buffer
+      std::string converted_output;
+
+      // whether the input has been read to the end, and whether any output has been converted (not counting the put area)
+      bool input_finished;
+      bool output_started;
+  };
+
   // determine whether a code point is a letter
   bool is_alpha(uint32_t code_point);
 
@@ -89,6 +401,994 @@ namespace utf {
   // convert a code point to titlecase (return the input if no titlecase form exists)
   uint32_t to_title(uint32_t code_point);
 
+  // the codecs below give compile-time access to one encoding, for loops that would otherwise test the encoding for
+  // every code point (decode returns the size of the code point at data, or 0 if it is malformed or truncated, and
+  // encode and get_encoded_size return the number of bytes a code point at most U+10FFFF takes, or 0 if the encoding
+  // can't represent it; decode_prev returns the size of the code point that ends at pos, or 0 if it is malformed, and
+  // align returns the start of the code point that contains pos, looking at no more than one code point, and
+  // get_malformed_size returns the size of the maximal malformed sequence at data where decode returns 0)
+  template <encoding_type encoding> struct codec;
+
+  template <> struct codec<ENCODING_ASCII> {
+    static const size_t unit_size = 1;
+    static const size_t max_char_size = 1;
+
+    static UTF_CONSTEXPR size_t decode(const uint8_t *data, size_t, uint32_t &code_point) {
+      code_point = data[0];
+      return data[0] < 0x80 ? 1 : 0;
+    }
+
+    static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+      return pos >= 1 ? decode(data+pos-1, 1, code_point) : 0;
+    }
+
+    static UTF_CONSTEXPR size_t align(const uint8_t *, size_t, size_t pos) {
+      return pos;
+    }
+
+    static UTF_CONSTEXPR size_t get_malformed_size(const uint8_t *, size_t) {
+      return 1;
+    }
+
+    static UTF_CONSTEXPR size_t get_encoded_size(uint32_t code_point) {
+      return code_point <= 0x7F ? 1 : 0;
+    }
+
+    static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+      output[0] = code_point;
+      return code_point <= 0x7F ? 1 : 0;
+    }
+  };
+
+  // the states of the UTF-8 state machine, which follows the table of well-formed byte sequences in the Unicode
+  // standard (so overlong forms, surrogates and code points above U+10FFFF are rejected at the first byte that rules
+  // them out), and the number of classes of bytes it tells apart
+  enum {
+    UTF8_ACCEPT, // at the start of a code point
+    UTF8_REJECT, // after a byte that can't continue the sequence
+    UTF8_NEED_1, // one more continuation byte
+    UTF8_NEED_2, // two more continuation bytes
+    UTF8_AFTER_E0, // A0 to BF, then one more
+    UTF8_AFTER_ED, // 80 to 9F, then one more
+    UTF8_NEED_3, // three more continuation bytes
+    UTF8_AFTER_F0, // 90 to BF, then two more
+    UTF8_AFTER_F4, // 80 to 8F, then two more
+    UTF8_BYTE_CLASSES = 12
+  };
+
+  // the tables of the UTF-8 state machine: the class of each byte (ASCII, the three ranges of continuation bytes, bytes
+  // that never appear, and the lead bytes that allow different ranges after them), and the state it moves to from each
+  // state on each class of byte (they are members of a class template so that there is one copy of them in a program)
+  #define UTF8_BYTE_CLASSES_DATA { \
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, \
+    3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, \
+    4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, \
+    6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 7, 9, 10, 10, 10, 11, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4 \
+  }
+  #define UTF8_TRANSITIONS_DATA { \
+    0, 1, 1, 1, 1, 2, 4, 3, 5, 7, 6, 8, \
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 3, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 1, 3, 3, 1, 1, 1, 1, 1, 1, 1, 1, \
+    1, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 \
+  }
+  template <typename T = void> struct utf8_state_machine {
+#if __cplusplus >= 201103L
+    static constexpr uint8_t byte_classes[256] = UTF8_BYTE_CLASSES_DATA;
+    static constexpr uint8_t transitions[9*UTF8_BYTE_CLASSES] = UTF8_TRANSITIONS_DATA;
+#else
+    static const uint8_t byte_classes[256];
+    static const uint8_t transitions[9*UTF8_BYTE_CLASSES];
+#endif
+  };
+
+  // the constexpr members still need a definition outside the class before C++17, and the const ones get their data
+  // there
+#if __cplusplus >= 201103L && __cplusplus < 201703L
+  template <typename T> constexpr uint8_t utf8_state_machine<T>::byte_classes[256];
+  template <typename T> constexpr uint8_t utf8_state_machine<T>::transitions[9*UTF8_BYTE_CLASSES];
+#elif __cplusplus < 201103L
+  template <typename T> const uint8_t utf8_state_machine<T>::byte_classes[256] = UTF8_BYTE_CLASSES_DATA;
+  template <typename T> const uint8_t utf8_state_machine<T>::transitions[9*UTF8_BYTE_CLASSES] = UTF8_TRANSITIONS_DATA;
+#endif
+  #undef UTF8_BYTE_CLASSES_DATA
+  #undef UTF8_TRANSITIONS_DATA
+
+  template <> struct codec<ENCODING_UTF8> {
+    static const size_t unit_size = 1;
+    static const size_t max_char_size = 4;
+
+    // get the size of the code point at data without decoding it, or 0 if it is malformed or truncated
+    static UTF_CONSTEXPR size_t get_char_size(const uint8_t *data, size_t available) {
+      // one byte
+      if (data[0] < 0x80)
+        return 1;
+
+      // run the state machine until it accepts or rejects (which takes at most 4 bytes)
+      size_t state = utf8_state_machine<>::transitions[utf8_state_machine<>::byte_classes[data[0]]];
+      size_t size = 1;
+      while (state > UTF8_REJECT && size < available)
+        state = utf8_state_machine<>::transitions[state*UTF8_BYTE_CLASSES+utf8_state_machine<>::byte_classes[data[size++]]];
+      return state == UTF8_ACCEPT ? size : 0;
+    }
+
+    static UTF_CONSTEXPR size_t decode(const uint8_t *data, size_t available, uint32_t &code_point) {
+      size_t size = get_char_size(data, available);
+      code_point = data[0];
+      if (size == 2)
+        code_point = ((data[0]&0x1F)<<6)+(data[1]&0x3F);
+      else if (size == 3)
+        code_point = ((data[0]&0x0F)<<12)+((data[1]&0x3F)<<6)+(data[2]&0x3F);
+      else if (size == 4)
+        code_point = ((data[0]&0x07)<<18)+((data[1]&0x3F)<<12)+((data[2]&0x3F)<<6)+(data[3]&0x3F);
+      return size;
+    }
+
+    static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+      // back up over at most 3 continuation bytes to the lead byte, which must start a code point that ends at pos
+      if (pos == 0)
+        return 0;
+      size_t start = pos-1;
+      while (start > 0 && pos-start < 4 && (data[start]&0xC0) == 0x80)
+        --start;
+      return decode(data+start, pos-start, code_point) == pos-start ? pos-start : 0;
+    }
+
+    static UTF_CONSTEXPR size_t align(const uint8_t *data, size_t size, size_t pos) {
+      // skip back over continuation bytes (there are at most 3 in a code point)
+      for (size_t i = 0; i < 3 && pos > 0 && pos < size && (data[pos]&0xC0) == 0x80; i++)
+        --pos;
+      return pos;
+    }
+
+    static UTF_CONSTEXPR size_t get_malformed_size(const uint8_t *data, size_t available) {
+      // take the bytes the state machine accepts before it rejects one (a byte that can't start a code point stands alone)
+      size_t state = utf8_state_machine<>::transitions[utf8_state_machine<>::byte_classes[data[0]]];
+      size_t size = 1;
+      while (state > UTF8_REJECT && size < available) {
+        state = utf8_state_machine<>::transitions[state*UTF8_BYTE_CLASSES+utf8_state_machine<>::byte_classes[data[size]]];
+        if (state == UTF8_REJECT)
+          break;
+        size++;
+      }
+      return size;
+    }
+
+    static UTF_CONSTEXPR size_t get_encoded_size(uint32_t code_point) {
+      if (code_point >= 0xD800 && code_point <= 0xDFFF)
+        return 0;
+      return code_point <= 0x7F ? 1 : code_point <= 0x7FF ? 2 : code_point <= 0xFFFF ? 3 : 4;
+    }
+
+    static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+      // one byte
+      if (code_point <= 0x7F) {
+        output[0] = code_point;
+        return 1;
+      }
+
+      // two bytes
+      if (code_point <= 0x7FF) {
+        output[0] = 0xC0+(code_point>>6);
+        output[1] = 0x80+(code_point&0x3F);
+        return 2;
+      }
+
+      // surrogates can't be encoded
+      if (code_point >= 0xD800 && code_point <= 0xDFFF)
+        return 0;
+
+      // three bytes
+      if (code_point <= 0xFFFF) {
+        output[0] = 0xE0+(code_point>>12);
+        output[1] = 0x80+((code_point>>6)&0x3F);
+        output[2] = 0x80+(code_point&0x3F);
+        return 3;
+      }
+
+      // four bytes
+      output[0] = 0xF0+(code_point>>18);
+      output[1] = 0x80+((code_point>>12)&0x3F);
+      output[2] = 0x80+((code_point>>6)&0x3F);
+      output[3] = 0x80+(code_point&0x3F);
+      return 4;
+    }
+  };
+
+  template <bool big_endian> struct utf16_codec {
+    static const size_t unit_size = 2;
+    static const size_t max_char_size = 4;
+
+    static UTF_CONSTEXPR uint16_t read_unit(const uint8_t *data) {
+      return big_endian ? (data[0]<<8)+data[1] : (data[1]<<8)+data[0];
+    }
+
+    static UTF_CONSTEXPR void write_unit(uint16_t unit, uint8_t *output) {
+      output[big_endian ? 0 : 1] = unit>>8;
+      output[big_endian ? 1 : 0] = unit&0xFF;
+    }
+
+    static UTF_CONSTEXPR size_t decode(const uint8_t *data, size_t available, uint32_t &code_point) {
+      // make sure there are 2 bytes
+      if (available < 2)
+        return 0;
+
+      // two bytes
+      uint16_t high = read_unit(data);
+      if (high < 0xD800 || high > 0xDFFF) {
+        code_point = high;
+        return 2;
+      }
+
+      // four bytes (a high surrogate followed by a low surrogate)
+      if (high > 0xDBFF || available < 4)
+        return 0;
+      uint16_t low = read_unit(data+2);
+      if (low < 0xDC00 || low > 0xDFFF)
+        return 0;
+      code_point = 0x10000+((high-0xD800)<<10)+(low-0xDC00);
+      return 4;
+    }
+
+    static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+      // a low surrogate ends a pair, and anything else stands alone
+      if (pos < 2)
+        return 0;
+      uint16_t last = read_unit(data+pos-2);
+      if (last >= 0xDC00 && last <= 0xDFFF)
+        return pos >= 4 ? (decode(data+pos-4, 4, code_point) == 4 ? 4 : 0) : 0;
+      return decode(data+pos-2, 2, code_point);
+    }
+
+    static UTF_CONSTEXPR size_t align(const uint8_t *data, size_t size, size_t pos) {
+      // round down to a code unit, and don't land on the low surrogate of a pair
+      pos -= pos%2;
+      if (pos >= 2 && pos+2 <= size) {
+        uint16_t unit = read_unit(data+pos);
+        uint16_t prev = read_unit(data+pos-2);
+        if (unit >= 0xDC00 && unit <= 0xDFFF && prev >= 0xD800 && prev <= 0xDBFF)
+          pos -= 2;
+      }
+      return pos;
+    }
+
+    static UTF_CONSTEXPR size_t get_malformed_size(const uint8_t *, size_t available) {
+      // a surrogate without its other half, or part of a code unit at the end
+      return available < 2 ? available : 2;
+    }
+
+    static UTF_CONSTEXPR size_t get_encoded_size(uint32_t code_point) {
+      return code_point >= 0xD800 && code_point <= 0xDFFF ? 0 : code_point <= 0xFFFF ? 2 : 4;
+    }
+
+    static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+      // two bytes
+      if (code_point <= 0xD7FF || (code_point >= 0xE000 && code_point <= 0xFFFF)) {
+        write_unit(code_point, output);
+        return 2;
+      }
+
+      // surrogates can't be encoded
+      if (code_point <= 0xDFFF)
+        return 0;
+
+      // four bytes
+      code_point -= 0x10000;
+      write_unit((code_point>>10)+0xD800, output);
+      write_unit((code_point&0x3FF)+0xDC00, output+2);
+      return 4;
+    }
+  };
+
+  template <bool big_endian> struct utf32_codec {
+    static const size_t unit_size = 4;
+    static const size_t max_char_size = 4;
+
+    static UTF_CONSTEXPR uint32_t read_unit(const uint8_t *data) {
+      return big_endian ? ((uint32_t)data[0]<<24)+(data[1]<<16)+(data[2]<<8)+data[3] : ((uint32_t)data[3]<<24)+(data[2]<<16)+(data[1]<<8)+data[0];
+    }
+
+    static UTF_CONSTEXPR size_t decode(const uint8_t *data, size_t available, uint32_t &code_point) {
+      if (available < 4)
+        return 0;
+      code_point = read_unit(data);
+      if (code_point > 0x10FFFF || (code_point >= 0xD800 && code_point <= 0xDFFF))
+        return 0;
+      return 4;
+    }
+
+    static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+      return pos >= 4 ? decode(data+pos-4, 4, code_point) : 0;
+    }
+
+    static UTF_CONSTEXPR size_t align(const uint8_t *, size_t, size_t pos) {
+      return pos-pos%4;
+    }
+
+    static UTF_CONSTEXPR size_t get_malformed_size(const uint8_t *, size_t available) {
+      return available < 4 ? available : 4;
+    }
+
+    static UTF_CONSTEXPR size_t get_encoded_size(uint32_t code_point) {
+      return code_point >= 0xD800 && code_point <= 0xDFFF ? 0 : 4;
+    }
+
+    static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+      // surrogates can't be encoded
+      if (code_point >= 0xD800 && code_point <= 0xDFFF)
+        return 0;
+
+      for (size_t i = 0; i < 4; i++)
+        output[big_endian ? 3-i : i] = (code_point>>(i*8))&0xFF;
+      return 4;
+    }
+  };
+
+  template <> struct codec<ENCODING_UTF16BE> : utf16_codec<true> {};
+  template <> struct codec<ENCODING_UTF16LE> : utf16_codec<false> {};
+  template <> struct codec<ENCODING_UTF32BE> : utf32_codec<true> {};
+  template <> struct codec<ENCODING_UTF32LE> : utf32_codec<false> {};
+
+  // the unchecked functions are for loops over text that is already known to be valid, so they skip the bounds and
+  // error checks of the codecs (decode_next returns the size of the code point at data, decode_prev returns the size of
+  // the code point that ends at pos, and encode returns the number of bytes a code point takes, where the code point
+  // must be at most U+10FFFF and not a surrogate; any other input gives an unspecified result)
+  namespace unchecked {
+
+    template <encoding_type encoding> struct codec;
+
+    template <> struct codec<ENCODING_ASCII> {
+      static UTF_CONSTEXPR size_t decode_next(const uint8_t *data, uint32_t &code_point) {
+        UTF_ASSUME_VALID(data[0] < 0x80);
+        code_point = data[0];
+        return 1;
+      }
+
+      static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+        UTF_ASSUME_VALID(pos >= 1);
+        return decode_next(data+pos-1, code_point);
+      }
+
+      static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+        UTF_ASSUME_VALID(code_point <= 0x7F);
+        output[0] = code_point;
+        return 1;
+      }
+    };
+
+    template <> struct codec<ENCODING_UTF8> {
+      static UTF_CONSTEXPR size_t decode_next(const uint8_t *data, uint32_t &code_point) {
+        // one byte
+        UTF_ASSUME_VALID(utf::codec<ENCODING_UTF8>::get_char_size(data, 4) != 0);
+        if (data[0] < 0x80) {
+          code_point = data[0];
+          return 1;
+        }
+
+        // the lead byte gives the size, and the low bits of each byte follow
+        size_t size = 2+(data[0] >= 0xE0)+(data[0] >= 0xF0);
+        uint32_t result = data[0]&(0x7F>>size);
+        for (size_t i = 1; i < size; i++)
+          result = (result<<6)+(data[i]&0x3F);
+        code_point = result;
+        return size;
+      }
+
+      static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+        // back up over the continuation bytes to the lead byte
+        UTF_ASSUME_VALID(pos >= 1);
+        size_t start = pos-1;
+        while ((data[start]&0xC0) == 0x80)
+          --start;
+        UTF_ASSUME_VALID(utf::codec<ENCODING_UTF8>::get_char_size(data+start, pos-start) == pos-start);
+        return decode_next(data+start, code_point);
+      }
+
+      static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+        UTF_ASSUME_VALID(code_point <= 0x10FFFF && utf::codec<ENCODING_UTF8>::get_encoded_size(code_point) != 0);
+
+        // one byte
+        if (code_point <= 0x7F) {
+          output[0] = code_point;
+          return 1;
+        }
+
+        // the size gives the marker bits of the lead byte, and each byte after it takes 6 bits
+        size_t size = 2+(code_point > 0x7FF)+(code_point > 0xFFFF);
+        for (size_t i = size-1; i > 0; i--) {
+          output[i] = 0x80+(code_point&0x3F);
+          code_point >>= 6;
+        }
+        output[0] = ((0xFF00>>size)&0xFF)+code_point;
+        return size;
+      }
+    };
+
+    template <bool big_endian> struct utf16_codec {
+      static UTF_CONSTEXPR size_t decode_next(const uint8_t *data, uint32_t &code_point) {
+        // a high surrogate is always followed by a low surrogate
+        UTF_ASSUME_VALID(utf::utf16_codec<big_endian>::decode(data, 4, code_point) != 0);
+        uint16_t high = utf::utf16_codec<big_endian>::read_unit(data);
+        if (high < 0xD800 || high > 0xDFFF) {
+          code_point = high;
+          return 2;
+        }
+        code_point = 0x10000+((high-0xD800)<<10)+(utf::utf16_codec<big_endian>::read_unit(data+2)-0xDC00);
+        return 4;
+      }
+
+      static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+        // a low surrogate ends a pair
+        UTF_ASSUME_VALID(utf::utf16_codec<big_endian>::decode_prev(data, pos, code_point) != 0);
+        uint16_t last = utf::utf16_codec<big_endian>::read_unit(data+pos-2);
+        return decode_next(data+pos-(last >= 0xDC00 && last <= 0xDFFF ? 4 : 2), code_point);
+      }
+
+      static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+        UTF_ASSUME_VALID(code_point <= 0x10FFFF && utf::utf16_codec<big_endian>::get_encoded_size(code_point) != 0);
+        if (code_point <= 0xFFFF) {
+          utf::utf16_codec<big_endian>::write_unit(code_point, output);
+          return 2;
+        }
+        code_point -= 0x10000;
+        utf::utf16_codec<big_endian>::write_unit((code_point>>10)+0xD800, output);
+        utf::utf16_codec<big_endian>::write_unit((code_point&0x3FF)+0xDC00, output+2);
+        return 4;
+      }
+    };
+
+    template <bool big_endian> struct utf32_codec {
+      static UTF_CONSTEXPR size_t decode_next(const uint8_t *data, uint32_t &code_point) {
+        UTF_ASSUME_VALID(utf::utf32_codec<big_endian>::decode(data, 4, code_point) != 0);
+        code_point = utf::utf32_codec<big_endian>::read_unit(data);
+        return 4;
+      }
+
+      static UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+        UTF_ASSUME_VALID(pos >= 4);
+        return decode_next(data+pos-4, code_point);
+      }
+
+      static UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+        UTF_ASSUME_VALID(code_point <= 0x10FFFF && utf::utf32_codec<big_endian>::get_encoded_size(code_point) != 0);
+        for (size_t i = 0; i < 4; i++)
+          output[big_endian ? 3-i : i] = (code_point>>(i*8))&0xFF;
+        return 4;
+      }
+    };
+
+    template <> struct codec<ENCODING_UTF16BE> : utf16_codec<true> {};
+    template <> struct codec<ENCODING_UTF16LE> : utf16_codec<false> {};
+    template <> struct codec<ENCODING_UTF32BE> : utf32_codec<true> {};
+    template <> struct codec<ENCODING_UTF32LE> : utf32_codec<false> {};
+
+    // decode the code point at data, or the one that ends at pos, or encode a code point in one encoding
+    template <encoding_type encoding> UTF_CONSTEXPR size_t decode_next(const uint8_t *data, uint32_t &code_point) {
+      return codec<encoding>::decode_next(data, code_point);
+    }
+    template <encoding_type encoding> UTF_CONSTEXPR size_t decode_prev(const uint8_t *data, size_t pos, uint32_t &code_point) {
+      return codec<encoding>::decode_prev(data, pos, code_point);
+    }
+    template <encoding_type encoding> UTF_CONSTEXPR size_t encode(uint32_t code_point, uint8_t *output) {
+      return codec<encoding>::encode(code_point, output);
+    }
+  }
+
+  // a code point decoded from a string, with the byte offset where it starts and the number of bytes it takes
+  struct decoded_char {
+    uint32_t code_point;
+    size_t offset;
+    size_t size;
+  };
+
+  // the decode functions of a codec, and the size of its code units
+  struct char_decoder {
+    size_t (*decode)(const uint8_t *data, size_t available, uint32_t &code_point);
+    size_t (*decode_prev)(const uint8_t *data, size_t pos, uint32_t &code_point);
+    size_t unit_size;
+  };
+
+  // iterate over the code points of a string in either direction, decoding each one once (a malformed code unit is
+  // yielded on its own as U+FFFD, so every byte is visited; validate the string first to reject them instead)
+  class code_point_iterator {
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef decoded_char value_type;
+      typedef ptrdiff_t difference_type;
+      typedef const decoded_char *pointer;
+      typedef decoded_char reference;
+
+      // constructors (an iterator at the end of the string decodes nothing)
+      code_point_iterator() : data(NULL), size(0) {
+        decoder.decode = NULL;
+        decoder.decode_prev = NULL;
+        decoder.unit_size = 1;
+        current.code_point = 0;
+        current.offset = 0;
+        current.size = 0;
+      }
+      code_point_iterator(const char *input, size_t input_size, size_t pos, const char_decoder &input_decoder) : data((const uint8_t *)input), size(input_size), decoder(input_decoder) {
+        current.offset = pos;
+        load();
+      }
+
+      // get the current code point (by value, since it lives in the iterator, which std::reverse_iterator dereferences
+      // as a temporary)
+      reference operator*() const { return current; }
+      pointer operator->() const { return &current; }
+
+      // move to the next code point
+      code_point_iterator &operator++() {
+        current.offset += current.size;
+        load();
+        return *this;
+      }
+      code_point_iterator operator++(int) {
+        code_point_iterator old = *this;
+        ++*this;
+        return old;
+      }
+
+      // move to the previous code point (a partial code unit at the end of the string comes first)
+      code_point_iterator &operator--() {
+        size_t end = current.offset;
+        current.code_point = 0xFFFD;
+        current.size = end%decoder.unit_size;
+        if (current.size == 0) {
+          current.size = decoder.decode_prev(data, end, current.code_point);
+          if (current.size == 0) {
+            current.code_point = 0xFFFD;
+            current.size = decoder.unit_size;
+          }
+        }
+        current.offset = end-current.size;
+        return *this;
+      }
+      code_point_iterator operator--(int) {
+        code_point_iterator old = *this;
+        --*this;
+        return old;
+      }
+
+      // compare the positions of two iterators over the same string
+      bool operator==(const code_point_iterator &other) const { return current.offset == other.current.offset; }
+      bool operator!=(const code_point_iterator &other) const { return current.offset != other.current.offset; }
+
+    private:
+      // decode the code point at the current offset
+      void load() {
+        current.code_point = 0;
+        current.size = 0;
+        if (current.offset >= size)
+          return;
+        current.size = decoder.decode(data+current.offset, size-current.offset, current.code_point);
+        if (current.size == 0) {
+          current.code_point = 0xFFFD;
+          current.size = size-current.offset < decoder.unit_size ? size-current.offset : decoder.unit_size;
+        }
+      }
+
+      // the string, and how to decode it
+      const uint8_t *data;
+      size_t size;
+      char_decoder decoder;
+
+      // the code point at the current offset
+      decoded_char current;
+  };
+
+  // a lazy range over the code points of a string, which refers to the string rather than copying it
+  class code_point_view {
+    public:
+      typedef code_point_iterator iterator;
+      typedef code_point_iterator const_iterator;
+
+      // constructors
+      code_point_view() : data(NULL), size(0) {
+        decoder.decode = NULL;
+        decoder.decode_prev = NULL;
+        decoder.unit_size = 1;
+      }
+      code_point_view(const char *input, size_t input_size, const char_decoder &input_decoder) : data(input), size(input_size), decoder(input_decoder) {}
+
+      // get the range of code points
+      code_point_iterator begin() const { return code_point_iterator(data, size, 0, decoder); }
+      code_point_iterator end() const { return code_point_iterator(data, size, size, decoder); }
+
+      // determine whether the string is empty
+      bool empty() const { return size == 0; }
+
+    private:
+      // the string, and how to decode it
+      const char *data;
+      size_t size;
+      char_decoder decoder;
+  };
+
+  // get a lazy range over the code points of a string
+  code_point_view code_points(const char *input, size_t input_size, encoding_type encoding);
+  code_point_view code_points(const std::string &input, encoding_type encoding);
+
+  // convert a string that is known to be valid (such as a text) from one encoding to another without validating it
+  // again, appending the result to output (malformed input gives an unspecified result, a code point the output
+  // encoding can't represent is still an error, and a BOM in the input is converted like any other code point)
+  void convert_valid_encoding(const char *input, size_t input_size, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output);
+
+  template <encoding_type Encoding> class text;
+
+  // iterate over the code points of a text in either direction, decoding each one once without checking it again
+  template <encoding_type Encoding> class text_iterator {
+    public:
+      typedef std::bidirectional_iterator_tag iterator_category;
+      typedef decoded_char value_type;
+      typedef ptrdiff_t difference_type;
+      typedef const decoded_char *pointer;
+      typedef decoded_char reference;
+
+      // constructors (an iterator at the end of the text decodes nothing)
+      text_iterator() : data(NULL), size(0) {
+        current.code_point = 0;
+        current.offset = 0;
+        current.size = 0;
+      }
+      text_iterator(const char *input, size_t input_size, size_t pos) : data((const uint8_t *)input), size(input_size) {
+        current.offset = pos;
+        load();
+      }
+
+      // get the current code point
+      reference operator*() const { return current; }
+      pointer operator->() const { return &current; }
+
+      // move to the next code point
+      text_iterator &operator++() {
+        current.offset += current.size;
+        load();
+        return *this;
+      }
+      text_iterator operator++(int) {
+        text_iterator old = *this;
+        ++*this;
+        return old;
+      }
+
+      // move to the previous code point
+      text_iterator &operator--() {
+        current.size = unchecked::decode_prev<Encoding>(data, current.offset, current.code_point);
+        current.offset -= current.size;
+        return *this;
+      }
+      text_iterator operator--(int) {
+        text_iterator old = *this;
+        --*this;
+        return old;
+      }
+
+      // compare the positions of two iterators over the same text
+      bool operator==(const text_iterator &other) const { return current.offset == other.current.offset; }
+      bool operator!=(const text_iterator &other) const { return current.offset != other.current.offset; }
+
+    private:
+      // decode the code point at the current offset
+      void load() {
+        current.code_point = 0;
+        current.size = 0;
+        if (current.offset < size)
+          current.size = unchecked::decode_next<Encoding>(data+current.offset, current.code_point);
+      }
+
+      // the text
+      const uint8_t *data;
+      size_t size;
+
+      // the code point at the current offset
+      decoded_char current;
+  };
+
+  // a string in one encoding that is known to be valid, because it is validated once when the view is made, so the
+  // operations on it don't validate it again; it keeps its number of code points and whether they are all ASCII, and
+  // refers to the string rather than copying it (so the string must outlive it)
+  template <encoding_type Encoding> class text_view {
+    public:
+      typedef text_iterator<Encoding> iterator;
+      typedef text_iterator<Encoding> const_iterator;
+
+      // constructors (validating the string, which throws an exception if it is malformed)
+      text_view() : text_data(""), text_size(0), text_length(0), ascii(true) {}
+      text_view(const char *input, size_t input_size);
+      explicit text_view(const std::string &input);
+
+      // validate a string and view it instead, leaving the view as it was if there is an error
+      status try_assign(const char *input, size_t input_size) UTF_NOEXCEPT;
+
+      // get the string
+      const char *data() const { return text_data; }
+      size_t size() const { return text_size; }
+      bool empty() const { return text_size == 0; }
+      std::string str() const { return std::string(text_data, text_size); }
+
+      // get the number of code points, and whether they are all ASCII
+      size_t length() const { return text_length; }
+      bool is_ascii() const { return ascii; }
+
+      // get the range of code points
+      iterator begin() const { return iterator(text_data, text_size, 0); }
+      iterator end() const { return iterator(text_data, text_size, text_size); }
+
+      // convert the text to another encoding (which throws an exception if the encoding can't represent a code point)
+      template <encoding_type Output> text<Output> convert() const;
+
+    private:
+      friend class text<Encoding>;
+
+      // constructor for a string known to be valid
+      text_view(const char *input, size_t input_size, size_t length, bool is_ascii) : text_data(input), text_size(input_size), text_length(length), ascii(is_ascii) {}
+
+      // the string, its number of code points, and whether they are all ASCII
+      const char *text_data;
+      size_t text_size;
+      size_t text_length;
+      bool ascii;
+  };
+
+  // the version of text_view that owns its string (which changes only in ways that keep it valid)
+  template <encoding_type Encoding> class text {
+    public:
+      typedef text_iterator<Encoding> iterator;
+      typedef text_iterator<Encoding> const_iterator;
+
+      // constructors (validating the string, which throws an exception if it is malformed, except when it comes from a
+      // view, which is already valid)
+      text() : text_length(0), ascii(true) {}
+      text(const char *input, size_t input_size);
+      explicit text(const std::string &input);
+      explicit text(const text_view<Encoding> &input) : contents(input.data(), input.size()), text_length(input.length()), ascii(input.is_ascii()) {}
+
+      // validate a string and copy it instead, leaving the text as it was if there is an error
+      status try_assign(const char *input, size_t input_size) UTF_NOEXCEPT;
+
+      // view the text (which is valid until the text changes)
+      text_view<Encoding> view() const { return text_view<Encoding>(contents.data(), contents.size(), text_length, ascii); }
+      operator text_view<Encoding>() const { return view(); }
+
+      // get the string
+      const char *data() const { return contents.data(); }
+      size_t size() const { return contents.size(); }
+      bool empty() const { return contents.empty(); }
+      const std::string &str() const { return contents; }
+
+      // get the number of code points, and whether they are all ASCII
+      size_t length() const { return text_length; }
+      bool is_ascii() const { return ascii; }
+
+      // get the range of code points
+      iterator begin() const { return iterator(contents.data(), contents.size(), 0); }
+      iterator end() const { return iterator(contents.data(), contents.size(), contents.size()); }
+
+      // add a code point to the end (which throws an exception if the encoding can't represent it)
+      void add_char(uint32_t code_point) {
+        utf::add_char(contents, code_point, Encoding);
+        ++text_length;
+        ascii = ascii && code_point < 0x80;
+      }
+
+      // add a text in the same encoding to the end
+      void append(const text_view<Encoding> &other) {
+        contents.append(other.data(), other.size());
+        text_length += other.length();
+        ascii = ascii && other.is_ascii();
+      }
+
+      // convert the text to another encoding (which throws an exception if the encoding can't represent a code point)
+      template <encoding_type Output> text<Output> convert() const { return view().template convert<Output>(); }
+
+    private:
+      template <encoding_type> friend class text_view;
+
+      // the string, its number of code points, and whether they are all ASCII
+      std::string contents;
+      size_t text_length;
+      bool ascii;
+  };
+
+  template <encoding_type Encoding> template <encoding_type Output> text<Output> text_view<Encoding>::convert() const {
+    // UTF-8 that is all ASCII converts as ASCII, which copies or widens each byte
+    text<Output> result;
+    convert_valid_encoding(text_data, text_size, Encoding == ENCODING_UTF8 && ascii ? ENCODING_ASCII : Encoding, Output, false, result.contents);
+    result.text_length = text_length;
+    result.ascii = ascii;
+    return result;
+  }
+
+  // an index of the code points in a string, which finds the byte offset of any code point from its position among
+  // the code points without walking the string from the start; the string is validated once when the index is built,
+  // and must outlive the index (the offset of every 256th code point is kept, so a lookup walks over at most 255
+  // others, and ASCII and UTF-32 need no offsets at all)
+  class code_point_index {
+    public:
+      // the number of code points between the offsets that are kept
+      static const size_t interval = 256;
+
+      // constructors (validating the string, which throws an exception if it is malformed)
+      code_point_index() : text_data(""), text_size(0), encoding(ENCODING_UTF8), text_length(0) {}
+      code_point_index(const char *input, size_t input_size, encoding_type input_encoding);
+      code_point_index(const std::string &input, encoding_type input_encoding);
+
+      // validate a string and index it instead, leaving the index as it was if there is an error
+      status try_assign(const char *input, size_t input_size, encoding_type input_encoding) UTF_NOEXCEPT;
+
+      // get the string
+      const char *data() const { return text_data; }
+      size_t size() const { return text_size; }
+      encoding_type get_encoding() const { return encoding; }
+
+      // get the number of code points
+      size_t length() const { return text_length; }
+
+      // get the byte offset of a code point (where the index of the length gives the end of the string), which throws
+      // an exception if the index is past the length
+      size_t get_offset(size_t index) const;
+
+      // get a code point, which throws an exception if the index is not less than the length
+      uint32_t get_char(size_t index) const;
+
+      // get up to count code points starting at index, which throws an exception if the index is past the length
+      std::string substr(size_t index, size_t count = (size_t)-1) const;
+
+    private:
+      // the string, its encoding and number of code points, and the offset of every code point at a multiple of the
+      // interval
+      const char *text_data;
+      size_t text_size;
+      encoding_type encoding;
+      size_t text_length;
+      std::vector<size_t> offsets;
+  };
+
+#if __cplusplus >= 201703L
+  // the string view overloads below wrap the (const char *, size_t) versions, so they don't copy the input
+
+  // the std::string_view overloads only match std::string_view itself, so that string literals don't become ambiguous
+  // between them and the std::string overloads
+  template <typename View, typename Result> struct string_view_only {};
+  template <typename Result> struct string_view_only<std::string_view, Result> { typedef Result type; };
+
+  template <typename View> inline typename string_view_only<View, encoding_type>::type detect_encoding(View input) {
+    return detect_encoding(input.data(), input.size());
+  }
+
+  template <typename View> inline typename string_view_only<View, std::vector<encoding_candidate> >::type detect_encodings(View input, size_t sample_size = 0) {
+    return detect_encodings(input.data(), input.size(), sample_size);
+  }
+
+  template <typename View> inline typename string_view_only<View, normalized_utf8>::type normalize_to_utf8(View input) {
+    return normalize_to_utf8(input.data(), input.size());
+  }
+
+  template <typename View> inline typename string_view_only<View, bool>::type is_valid(View input, encoding_type encoding) {
+    return is_valid(input.data(), input.size(), encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, bool>::type is_valid(View input, encoding_type encoding, size_t &length) {
+    return is_valid(input.data(), input.size(), encoding, length);
+  }
+
+  template <typename View> inline typename string_view_only<View, std::string>::type convert_encoding(View input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+    return convert_encoding(input.data(), input.size(), input_encoding, output_encoding, include_bom);
+  }
+
+  template <typename View> inline typename string_view_only<View, void>::type convert_encoding(View input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom, std::string &output) {
+    convert_encoding(input.data(), input.size(), input_encoding, output_encoding, include_bom, output);
+  }
+
+  template <typename View> inline typename string_view_only<View, std::string>::type convert_encoding_lossy(View input, encoding_type input_encoding, encoding_type output_encoding, bool include_bom) {
+    return convert_encoding_lossy(input.data(), input.size(), input_encoding, output_encoding, include_bom);
+  }
+
+  template <typename View> inline typename string_view_only<View, size_t>::type get_length(View input, encoding_type encoding) {
+    return get_length(input.data(), input.size(), encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, size_t>::type get_char_size(View input, size_t pos, encoding_type encoding) {
+    return get_char_size(input.data(), input.size(), pos, encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, uint32_t>::type get_char(View input, size_t pos, encoding_type encoding) {
+    return get_char(input.data(), input.size(), pos, encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, size_t>::type get_prev_char_size(View input, size_t pos, encoding_type encoding) {
+    return get_prev_char_size(input.data(), input.size(), pos, encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, uint32_t>::type get_prev_char(View input, size_t pos, encoding_type encoding) {
+    return get_prev_char(input.data(), input.size(), pos, encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, size_t>::type align_to_boundary(View input, size_t pos, encoding_type encoding) {
+    return align_to_boundary(input.data(), input.size(), pos, encoding);
+  }
+
+  template <typename View> inline typename string_view_only<View, code_point_view>::type code_points(View input, encoding_type encoding) {
+    return code_points(input.data(), input.size(), encoding);
+  }
+
+  // get the encoding of UTF-16 or UTF-32 code units in the native byte order
+  inline encoding_type get_native_encoding(std::u16string_view) {
+    const uint16_t unit = 1;
+    return *(const uint8_t *)&unit ? ENCODING_UTF16LE : ENCODING_UTF16BE;
+  }
+  inline encoding_type get_native_encoding(std::u32string_view) {
+    const uint32_t unit = 1;
+    return *(const uint8_t *)&unit ? ENCODING_UTF32LE : ENCODING_UTF32BE;
+  }
+
+  // std::u16string_view and std::u32string_view hold code units in the native byte order, so they take no input
+  // encoding, and their positions and sizes are in code units rather than bytes
+  inline bool is_valid(std::u16string_view input) {
+    return is_valid((const char *)input.data(), input.size()*2, get_native_encoding(input));
+  }
+  inline bool is_valid(std::u32string_view input) {
+    return is_valid((const char *)input.data(), input.size()*4, get_native_encoding(input));
+  }
+
+  inline bool is_valid(std::u16string_view input, size_t &length) {
+    return is_valid((const char *)input.data(), input.size()*2, get_native_encoding(input), length);
+  }
+  inline bool is_valid(std::u32string_view input, size_t &length) {
+    return is_valid((const char *)input.data(), input.size()*4, get_native_encoding(input), length);
+  }
+
+  inline std::string convert_encoding(std::u16string_view input, encoding_type output_encoding, bool include_bom) {
+    return convert_encoding((const char *)input.data(), input.size()*2, get_native_encoding(input), output_encoding, include_bom);
+  }
+  inline std::string convert_encoding(std::u32string_view input, encoding_type output_encoding, bool include_bom) {
+    return convert_encoding((const char *)input.data(), input.size()*4, get_native_encoding(input), output_encoding, include_bom);
+  }
+
+  inline void convert_encoding(std::u16string_view input, encoding_type output_encoding, bool include_bom, std::string &output) {
+    convert_encoding((const char *)input.data(), input.size()*2, get_native_encoding(input), output_encoding, include_bom, output);
+  }
+  inline void convert_encoding(std::u32string_view input, encoding_type output_encoding, bool include_bom, std::string &output) {
+    convert_encoding((const char *)input.data(), input.size()*4, get_native_encoding(input), output_encoding, include_bom, output);
+  }
+
+  inline size_t get_length(std::u16string_view input) {
+    return get_length((const char *)input.data(), input.size()*2, get_native_encoding(input));
+  }
+  inline size_t get_length(std::u32string_view input) {
+    return get_length((const char *)input.data(), input.size()*4, get_native_encoding(input));
+  }
+
+  inline size_t get_char_size(std::u16string_view input, size_t pos) {
+    return get_char_size((const char *)input.data(), input.size()*2, pos*2, get_native_encoding(input))/2;
+  }
+  inline size_t get_char_size(std::u32string_view input, size_t pos) {
+    return get_char_size((const char *)input.data(), input.size()*4, pos*4, get_native_encoding(input))/4;
+  }
+
+  inline uint32_t get_char(std::u16string_view input, size_t pos) {
+    return get_char((const char *)input.data(), input.size()*2, pos*2, get_native_encoding(input));
+  }
+  inline uint32_t get_char(std::u32string_view input, size_t pos) {
+    return get_char((const char *)input.data(), input.size()*4, pos*4, get_native_encoding(input));
+  }
+#endif
+
 }
 
+#if __cplusplus >= 202002L
+  // a code point view is a view, and its iterators point into the string rather than the view
+  template <> inline constexpr bool std::ranges::enable_view<utf::code_point_view> = true;
+  template <> inline constexpr bool std::ranges::enable_borrowed_range<utf::code_point_view> = true;
+#endif
+
 #endif
\ No newline at end of file